@@ -0,0 +1,456 @@
+/*
+ * Provider benchmark. Replays recorded responses from a local stand-in
+ * server and reports time, bytes, allocations and peak rss of provider
+ * calls with a cold and a warm cache.
+ *
+ * ctv-bench [-f fixtures] [-l latency_ms] [-b bandwidth_kb] [-r]
+ *
+ * -r records missing fixtures from the live sites, it needs the tokens
+ * of an activated box in ~/.local/etvcc.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "provider.h"
+#include "etvnet.h"
+#include "smithsonian.h"
+#include "http.h"
+#include "pack.h"
+#include "rlog.h"
+#include "metrics.h"
+
+struct site {
+	const char *prefix;     /* path prefix on the stand-in */
+	const char *env;        /* provider root override */
+	const char *upstream;   /* live root for recording */
+};
+
+static const struct site sites[] = {
+	{ "/etvnet/", "CTV_ETVNET_API", "https://secure.etvnet.com/api/v3.0/" },
+	{ "/smithsonian", "CTV_SMITHSONIAN_ROOT", "http://www.smithsonianchannel.com" },
+	{ NULL, NULL, NULL }
+};
+
+static char fixtures_dir[PATH_MAX] = "fixtures";
+static int latency_ms = 50;
+static int bandwidth_kb = 1024;
+static bool record = false;
+
+static atomic_ullong bytes_served;
+static atomic_ullong allocations;
+
+/* count allocations, glibc allows to replace malloc */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *
+malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __libc_realloc(p, size);
+}
+
+/* path and query without the access token to a file name */
+static void
+fixture_name(const char *path, char *fname)
+{
+	char key[PATH_MAX];
+	char *p, *token;
+	size_t n = 0;
+
+	snprintf(key, sizeof(key), "%s", path);
+	token = strstr(key, "access_token=");
+	if (token != NULL) {
+		p = strchr(token, '&');
+		if (p != NULL)
+			memmove(token, p + 1, strlen(p + 1) + 1);
+		else
+			*token = 0;
+	}
+
+	n = strlen(key);
+	while (n > 0 && (key[n-1] == '&' || key[n-1] == '?'))
+		key[--n] = 0;
+
+	for (p = key + 1; *p; p++) {
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+		      (*p >= '0' && *p <= '9') || *p == '.' || *p == '-'))
+			*p = '_';
+	}
+
+	snprintf(fname, PATH_MAX-1, "%s/%s", fixtures_dir, key + 1);
+}
+
+static char *
+read_file(const char *fname, size_t *len)
+{
+	FILE *f = fopen(fname, "rb");
+	struct stat st;
+	char *data;
+
+	if (f == NULL)
+		return NULL;
+
+	/* stand-in allocations are not counted */
+	fstat(fileno(f), &st);
+	data = __libc_malloc(st.st_size + 1);
+	*len = fread(data, 1, st.st_size, f);
+	fclose(f);
+
+	return data;
+}
+
+static char *
+record_fixture(const char *path, const char *fname, size_t *len)
+{
+	const struct site *s;
+	char url[PATH_MAX];
+	char error[256];
+	struct http_buf buf = { 0 };
+	struct http_opts opts = { .buf = &buf, .error = error, .error_size = sizeof(error) };
+	FILE *f;
+
+	for (s = sites; s->prefix != NULL; s++) {
+		if (strncmp(path, s->prefix, strlen(s->prefix)) == 0)
+			break;
+	}
+	if (s->prefix == NULL)
+		return NULL;
+
+	snprintf(url, sizeof(url), "%s%s", s->upstream, path + strlen(s->prefix));
+	if (http_get(url, &opts) != 0) {
+		fprintf(stderr, "record %s: %s\n", url, error);
+		http_buf_clean(&buf);
+		return NULL;
+	}
+
+	f = fopen(fname, "wb");
+	if (f != NULL) {
+		fwrite(buf.data, 1, buf.len, f);
+		fclose(f);
+	}
+
+	*len = buf.len;
+	return buf.data;
+}
+
+static void
+send_all(int fd, const char *data, size_t len, bool throttle)
+{
+	const size_t chunk = 4096;
+	size_t off = 0;
+
+	while (off < len) {
+		size_t n = (len - off < chunk) ? len - off : chunk;
+		ssize_t rc = send(fd, data + off, n, MSG_NOSIGNAL);
+		if (rc <= 0)
+			return;
+		off += rc;
+		if (throttle && bandwidth_kb > 0)
+			usleep(rc * 1000000ULL / (bandwidth_kb * 1024ULL));
+	}
+}
+
+static void *
+serve(void *arg)
+{
+	int fd = (intptr_t)arg;
+	char req[8192];
+	char path[4096];
+	char fname[PATH_MAX];
+	char header[256];
+	size_t len = 0, n = 0;
+	ssize_t rc;
+	char *body;
+
+	/* headers only, stand-in serves GET */
+	while (n < sizeof(req) - 1 && (rc = recv(fd, req + n, sizeof(req) - 1 - n, 0)) > 0) {
+		n += rc;
+		req[n] = 0;
+		if (strstr(req, "\r\n\r\n") != NULL)
+			break;
+	}
+	req[n] = 0;
+
+	if (sscanf(req, "GET %4095s", path) != 1) {
+		close(fd);
+		return NULL;
+	}
+
+	usleep(latency_ms * 1000);
+
+	fixture_name(path, fname);
+	body = read_file(fname, &len);
+	if (body == NULL && record)
+		body = record_fixture(path, fname, &len);
+
+	if (body == NULL) {
+		fprintf(stderr, "no fixture %s\n", fname);
+		snprintf(header, sizeof(header),
+			 "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		send_all(fd, header, strlen(header), false);
+	} else {
+		snprintf(header, sizeof(header),
+			 "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", len);
+		atomic_fetch_add(&bytes_served, len);
+		send_all(fd, header, strlen(header), false);
+		send_all(fd, body, len, true);
+		free(body);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static void *
+server(void *arg)
+{
+	int lfd = (intptr_t)arg;
+	pthread_t th;
+
+	while (true) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd == -1)
+			continue;
+
+		if (pthread_create(&th, NULL, serve, (void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(th);
+	}
+
+	return NULL;
+}
+
+static int
+start_server()
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addr_len = sizeof(addr);
+	pthread_t th;
+	int lfd;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(lfd, 16) != 0 || getsockname(lfd, (struct sockaddr *)&addr, &addr_len) != 0) {
+		perror("stand-in server");
+		return -1;
+	}
+
+	if (pthread_create(&th, NULL, server, (void *)(intptr_t)lfd) != 0)
+		return -1;
+	pthread_detach(th);
+
+	return ntohs(addr.sin_port);
+}
+
+struct sample {
+	uint64_t start;
+	unsigned long long bytes;
+	unsigned long long allocs;
+};
+
+static void
+sample_start(struct sample *s)
+{
+	s->bytes = atomic_load(&bytes_served);
+	s->allocs = atomic_load(&allocations);
+	s->start = metrics_now();
+}
+
+/* one line per measurement: provider op cache key value ... */
+static void
+sample_print(const struct sample *s, const char *provider, const char *op, const char *cache, bool ok)
+{
+	uint64_t usec = metrics_now() - s->start;
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-12s %-15s %-5s %s time_us %8llu bytes %8llu allocs %8llu maxrss_kb %6ld\n",
+	       provider, op, cache, ok ? "ok  " : "fail",
+	       (unsigned long long)usec,
+	       atomic_load(&bytes_served) - s->bytes,
+	       atomic_load(&allocations) - s->allocs,
+	       ru.ru_maxrss);
+}
+
+/* the selected tab first, then the others, lists with tabs have no items */
+static struct movie_entry *
+first_with(struct movie_list *list, bool children)
+{
+	struct movie_entry *e;
+	int i;
+
+	if (list == NULL)
+		return NULL;
+
+	if (list->tabs_count > 0) {
+		e = first_with(list->tabs[list->tab], children);
+		for (i = 0; e == NULL && i < list->tabs_count; i++)
+			e = first_with(list->tabs[i], children);
+		return e;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		e = list->items[i];
+		if ((e->children_count > 0) == children)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void
+bench_provider(struct provider *(*get_provider)(), const char *cache)
+{
+	struct provider *p = get_provider();
+	struct movie_list *list;
+	struct movie_entry *e;
+	struct sample s;
+
+	sample_start(&s);
+	list = p->load();
+	sample_print(&s, p->name, "load", cache, list != NULL && p->error_number == 0);
+
+	e = first_with(list, true);
+	if (p->get_movie != NULL && e == NULL)
+		fprintf(stderr, "%s: no entry with children for get_movie\n", p->name);
+	if (p->get_movie != NULL && e != NULL) {
+		sample_start(&s);
+		struct movie_entry *child = p->get_movie(e->id, 0);
+		sample_print(&s, p->name, "get_movie", cache, child != NULL);
+	}
+
+	e = first_with(list, false);
+	if (p->get_stream_url != NULL && e == NULL)
+		fprintf(stderr, "%s: no entry without children for get_stream_url\n", p->name);
+	if (p->get_stream_url != NULL && e != NULL) {
+		sample_start(&s);
+		char *url = p->get_stream_url(e);
+		sample_print(&s, p->name, "get_stream_url", cache, url != NULL);
+		free(url);
+	}
+}
+
+static void
+usage()
+{
+	printf("usage: ctv-bench [-f fixtures] [-l latency_ms] [-b bandwidth_kb] [-r]\n"
+	       "  -f    directory with recorded responses, default fixtures\n"
+	       "  -l    latency of every response, default 50 ms\n"
+	       "  -b    bandwidth, default 1024 KB/s, 0 is unlimited\n"
+	       "  -r    record missing fixtures from the live sites\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	char home[PATH_MAX];
+	char dir[PATH_MAX];
+	char fname[PATH_MAX];
+	char root[PATH_MAX];
+	const struct site *s;
+	int ch, port;
+	FILE *f;
+
+	while ((ch = getopt(argc, argv, "f:l:b:rh")) != -1) {
+		switch (ch) {
+			case 'f':
+				snprintf(fixtures_dir, PATH_MAX-1, "%s", optarg);
+				break;
+			case 'l':
+				latency_ms = atoi(optarg);
+				break;
+			case 'b':
+				bandwidth_kb = atoi(optarg);
+				break;
+			case 'r':
+				record = true;
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	rlog_init(NULL, 0, RLOG_WARN);
+	http_init();
+
+	port = start_server();
+	if (port == -1)
+		return 1;
+
+	for (s = sites; s->prefix != NULL; s++) {
+		snprintf(root, sizeof(root), "http://127.0.0.1:%d%s", port, s->prefix);
+		setenv(s->env, root, 1);
+	}
+
+	/* private home with a token, recording needs the real one */
+	snprintf(home, sizeof(home), "/tmp/ctv-bench-%d", getpid());
+	snprintf(dir, sizeof(dir), "%s/.local/etvcc", home);
+	mkdir(home, 0700);
+	snprintf(fname, sizeof(fname), "%s/.local", home);
+	mkdir(fname, 0700);
+	mkdir(dir, 0700);
+	snprintf(fname, sizeof(fname), "%s/.cache", home);
+	mkdir(fname, 0700);
+	snprintf(fname, sizeof(fname), "%s/.cache/etvcc", home);
+	mkdir(fname, 0700);
+
+	snprintf(fname, sizeof(fname), "%s/token.json", dir);
+	f = fopen(fname, "wt");
+	if (f != NULL) {
+		fprintf(f, "{\"access_token\": \"bench\", \"refresh_token\": \"bench\"}\n");
+		fclose(f);
+	}
+
+	if (!record)
+		setenv("HOME", home, 1);
+
+	snprintf(fname, sizeof(fname), "%s/cache.pack", home);
+	pack_open(fname, 64 * 1024 * 1024);
+
+	printf("# latency_ms %d bandwidth_kb %d\n", latency_ms, bandwidth_kb);
+
+	bench_provider(etvnet_get_provider, "cold");
+	bench_provider(etvnet_get_provider, "warm");
+	bench_provider(smithsonian_get_provider, "cold");
+	bench_provider(smithsonian_get_provider, "warm");
+
+	pack_close();
+	unlink(fname);
+	snprintf(fname, sizeof(fname), "rm -rf %s", home);
+	system(fname);
+
+	return 0;
+}
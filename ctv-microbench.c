@@ -0,0 +1,430 @@
+/*
+ * Microbenchmarks of the parsing and list building paths.
+ * Prints csv: name,size,iterations,ns_per_op,arch,version
+ *
+ * ctv-microbench [-t msec] [name]
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <regex.h>
+#include <sys/utsname.h>
+#include <json-c/json.h>
+#include "common/regexp.h"
+#include "provider.h"
+#include "etvnet.h"
+#include "smithsonian.h"
+#include "selections.h"
+#include "search.h"
+#include "util.h"
+#include "metrics.h"
+#include "version.h"
+
+#define CHUNKS 20
+
+/* patterns of the regex scraper smithsonian used before libxml2, kept as a baseline */
+#define SMITH_CHUNK_START "data-premium=\""
+#define SMITH_CHUNK_END "</li>"
+#define SMITH_REX_EPISODE "href=\"([^\"]+)\".*srcset=\"([^\"]+)\""
+#define SMITH_REX_TITLE "property=\"og:title\" content=\"([^\"]+)\""
+#define SMITH_REX_BCID "data-bcid=\"([^\"]+)\""
+
+static int min_msec = 200;
+static const char *only;
+static char arch[64];
+
+static void
+report(const char *name, int size, void (*fn)(void *), void *arg)
+{
+	uint64_t start, usec;
+	long iters = 0;
+
+	if (only != NULL && strstr(name, only) == NULL)
+		return;
+
+	start = metrics_now();
+	do {
+		fn(arg);
+		iters++;
+		usec = metrics_now() - start;
+	} while (usec < min_msec * 1000ULL);
+
+	printf("%s,%d,%ld,%llu,%s,%s\n", name, size, iters,
+	       (unsigned long long)(usec * 1000 / iters), arch, app_version);
+	fflush(stdout);
+}
+
+/* episodes page of about size bytes with CHUNKS episodes spread over it */
+static char *
+make_page(int size)
+{
+	static const char filler[] =
+		"<div class=\"promo\"><a href=\"/shows/aerial-america\"><img src=\"/img/promo.jpg\" "
+		"alt=\"promo\"></a><span>Watch the full series tonight</span></div>\n";
+	char *page = malloc(size + 4096);
+	int len = 0, i;
+
+	len += sprintf(page, "<!DOCTYPE html><html><head><title>Full Episodes</title></head><body>\n");
+
+	for (i = 0; i < CHUNKS; i++) {
+		while (len < size * (i + 1) / (CHUNKS + 1))
+			len += sprintf(page + len, "%s", filler);
+
+		len += sprintf(page + len,
+			"<li class=\"episode\" data-premium=\"false\">\n"
+			"<a href=\"/full-episodes/episode-%d\" class=\"link\">\n"
+			"<img class=\"thumb\" srcset=\"/img/episode-%d-320.jpg 320w, /img/episode-%d-640.jpg 640w\">\n"
+			"<h3>Episode %d</h3><p>The story of the mysterious wreck.</p>\n"
+			"</a>\n</li>\n", i, i, i, i);
+	}
+
+	while (len < size)
+		len += sprintf(page + len, "%s", filler);
+	sprintf(page + len, "</body></html>\n");
+
+	return page;
+}
+
+/* episode page with og:title in the head and the player at the end */
+static char *
+make_episode(int size)
+{
+	static const char head[] = "<head>";
+	char *page = make_page(size);
+	char *p = malloc(strlen(page) + 256);
+	char *h = strstr(page, head) + strlen(head);
+	char *end = strstr(page, "</body>");
+
+	*end = 0;
+	sprintf(p, "%.*s<meta property=\"og:title\" content=\"Aerial America: Alaska\">%s"
+		"<div class=\"player\" data-bcid=\"4800000000017\"></div>\n</body></html>\n",
+		(int)(h - page), page, h);
+	free(page);
+
+	return p;
+}
+
+struct chunks_arg {
+	char *text;
+	regmatch_t m[CHUNKS];
+};
+
+static void
+bench_match_chunks(void *arg)
+{
+	struct chunks_arg *a = arg;
+
+	match_chunks(a->text, CHUNKS, a->m, SMITH_CHUNK_START, SMITH_CHUNK_END);
+}
+
+/* same delimiters written as regexes, takes the cached regex path */
+static void
+bench_match_chunks_regex(void *arg)
+{
+	struct chunks_arg *a = arg;
+
+	match_chunks(a->text, CHUNKS, a->m, "data-premium=[\"]", "</l[i]>");
+}
+
+static void
+bench_split_chunks(void *arg)
+{
+	struct chunks_arg *a = arg;
+	char *chunks[CHUNKS];
+
+	split_chunks(a->text, CHUNKS, a->m, chunks);
+}
+
+static void
+bench_parse_episodes(void *arg)
+{
+	const char *page = arg;
+	char *urls[CHUNKS];
+	int i, n;
+
+	n = smith_parse_episodes(page, strlen(page), urls, CHUNKS);
+	for (i = 0; i < n; i++)
+		free(urls[i]);
+}
+
+static void
+bench_parse_episode(void *arg)
+{
+	const char *page = arg;
+	char *title, *bcid;
+
+	if (smith_parse_episode(page, strlen(page), &title, &bcid) == 0) {
+		free(title);
+		free(bcid);
+	}
+}
+
+struct regex_arg {
+	regex_t rex;
+	const char *text;
+};
+
+static void
+bench_regex(void *arg)
+{
+	struct regex_arg *a = arg;
+	regmatch_t m[4];
+
+	regexec(&a->rex, a->text, 4, m, 0);
+}
+
+static void
+bench_create_movie(void *arg)
+{
+	json_object *bookmarks = arg;
+	int i, n = json_object_array_length(bookmarks);
+
+	for (i = 0; i < n; i++)
+		free_movie(etvnet_create_movie(json_object_array_get_idx(bookmarks, i)));
+}
+
+static void
+bench_lowest_bitrate(void *arg)
+{
+	json_object *files = arg;
+	struct movie_entry e;
+
+	etvnet_set_lowest_bitrate(files, &e);
+}
+
+static json_object *
+make_bookmarks(int n)
+{
+	char *json = malloc(n * 512 + 64);
+	int len = 0, i;
+
+	len += sprintf(json, "[");
+	for (i = 0; i < n; i++) {
+		len += sprintf(json + len,
+			"%s{\"id\": %d, \"children_count\": %d, \"name\": \"Тайны века %d\", "
+			"\"description\": \"Документальный сериал о событиях прошлого века\", "
+			"\"on_air\": \"2016-05-%02d\", \"files\": ["
+			"{\"bitrate\": 600, \"format\": \"wmv\"}, {\"bitrate\": 1200, \"format\": \"wmv\"}, "
+			"{\"bitrate\": 400, \"format\": \"mp4\"}, {\"bitrate\": 1500, \"format\": \"mp4\"}]}",
+			i ? ", " : "", 100000 + i, i % 3 ? 0 : 24, i, i % 28 + 1);
+	}
+	sprintf(json + len, "]");
+
+	json_object *root = json_tokener_parse(json);
+	free(json);
+
+	return root;
+}
+
+static struct movie_entry *
+new_movie(int i)
+{
+	struct movie_entry *e = calloc(1, sizeof(struct movie_entry));
+
+	e->id = 100000 + i;
+	e->children_count = 24;
+	e->sel = i % 24;
+
+	return e;
+}
+
+static void
+free_list(struct movie_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++)
+		free(list->items[i]);
+	free(list->items);
+	free(list);
+}
+
+static void
+bench_append_movie(void *arg)
+{
+	int n = *(int *)arg, i;
+	struct movie_list *list = calloc(1, sizeof(struct movie_list));
+
+	for (i = 0; i < n; i++)
+		append_movie(list, new_movie(i));
+
+	free_list(list);
+}
+
+struct selections_arg {
+	char fname[64];
+	struct movie_list *list;
+};
+
+static void
+bench_load_selections(void *arg)
+{
+	struct selections_arg *a = arg;
+
+	selections_load(a->fname, a->list);
+}
+
+static void
+make_name(int i, char *name, size_t size)
+{
+	static const char *words[] = {
+		"Тайны", "века", "Следствие", "вели", "Вечерний", "Ургант", "Пусть", "говорят",
+		"Жди", "меня", "Ёлки", "Сериал", "Новости", "Время", "Поле", "чудес"
+	};
+	unsigned h = i * 2654435761u;
+
+	snprintf(name, size, "%s %s %s, серия %d", words[h % 16], words[(h >> 8) % 16],
+		 words[(h >> 16) % 16], i % 100 + 1);
+}
+
+static void
+bench_search_build(void *arg)
+{
+	int n = *(int *)arg, i;
+	struct search_index *ix = search_new();
+	char name[128];
+
+	for (i = 0; i < n; i++) {
+		make_name(i, name, sizeof(name));
+		search_add(ix, name);
+	}
+
+	search_free(ix);
+}
+
+struct search_arg {
+	struct search_index *ix;
+	const char *query;
+};
+
+static void
+bench_search_find(void *arg)
+{
+	struct search_arg *a = arg;
+	int ids[100];
+
+	search_find(a->ix, a->query, ids, 100);
+}
+
+static void
+usage()
+{
+	printf("usage: ctv-microbench [-t msec] [name]\n"
+	       "  -t    minimal time of every benchmark, default 200 msec\n"
+	       "  name  run benchmarks containing name\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int page_sizes[] = { 16 * 1024, 128 * 1024, 1024 * 1024 };
+	static const int list_sizes[] = { 10, 1000, 100000 };
+	struct chunks_arg chunks;
+	struct regex_arg rex;
+	struct selections_arg sel;
+	struct search_arg search;
+	char name[128];
+	struct utsname un;
+	json_object *bookmarks, *files;
+	char *page;
+	int ch, i, j;
+
+	while ((ch = getopt(argc, argv, "t:h")) != -1) {
+		switch (ch) {
+			case 't':
+				min_msec = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (optind < argc)
+		only = argv[optind];
+
+	uname(&un);
+	snprintf(arch, sizeof(arch), "%s", un.machine);
+
+	printf("name,size,iterations,ns_per_op,arch,version\n");
+
+	for (i = 0; i < 3; i++) {
+		page = make_page(page_sizes[i]);
+		chunks.text = page;
+		report("parse_episodes", page_sizes[i], bench_parse_episodes, page);
+		report("match_chunks", page_sizes[i], bench_match_chunks, &chunks);
+		report("match_chunks_regex", page_sizes[i], bench_match_chunks_regex, &chunks);
+		/* terminates the chunks in place, keep it last */
+		report("split_chunks", page_sizes[i], bench_split_chunks, &chunks);
+		free(page);
+	}
+
+	page = make_page(16 * 1024);
+	match_chunks(page, CHUNKS, chunks.m, SMITH_CHUNK_START, SMITH_CHUNK_END);
+	rex.text = page + chunks.m[CHUNKS / 2].rm_so;
+	page[chunks.m[CHUNKS / 2].rm_eo] = 0;
+	regex_compile(&rex.rex, SMITH_REX_EPISODE);
+	report("rex_episode", strlen(rex.text), bench_regex, &rex);
+	regfree(&rex.rex);
+	free(page);
+
+	for (i = 0; i < 2; i++) {
+		page = make_episode(page_sizes[i]);
+		rex.text = page;
+		regex_compile(&rex.rex, SMITH_REX_TITLE);
+		report("rex_title", page_sizes[i], bench_regex, &rex);
+		regfree(&rex.rex);
+		regex_compile(&rex.rex, SMITH_REX_BCID);
+		report("rex_bcid", page_sizes[i], bench_regex, &rex);
+		regfree(&rex.rex);
+		report("parse_episode", page_sizes[i], bench_parse_episode, page);
+		free(page);
+	}
+
+	bookmarks = make_bookmarks(20);
+	report("create_movie", 20, bench_create_movie, bookmarks);
+	json_object_object_get_ex(json_object_array_get_idx(bookmarks, 0), "files", &files);
+	report("set_lowest_bitrate", json_object_array_length(files), bench_lowest_bitrate, files);
+	json_object_put(bookmarks);
+
+	for (i = 0; i < 3; i++)
+		report("append_movie", list_sizes[i], bench_append_movie, (void *)&list_sizes[i]);
+
+	snprintf(sel.fname, sizeof(sel.fname), "/tmp/ctv-microbench-%d.txt", getpid());
+	for (i = 0; i < 3; i++) {
+		sel.list = calloc(1, sizeof(struct movie_list));
+		for (j = 0; j < list_sizes[i]; j++)
+			append_movie(sel.list, new_movie(j));
+
+		selections_save(sel.fname, sel.list);
+		report("load_selections", list_sizes[i], bench_load_selections, &sel);
+		free_list(sel.list);
+	}
+	unlink(sel.fname);
+
+	/* common word, rare combination, one letter and no match */
+	for (i = 0; i < 3; i++) {
+		report("search_build", list_sizes[i], bench_search_build, (void *)&list_sizes[i]);
+
+		search.ix = search_new();
+		for (j = 0; j < list_sizes[i]; j++) {
+			make_name(j, name, sizeof(name));
+			search_add(search.ix, name);
+		}
+
+		search.query = "ТАЙНЫ";
+		report("search_find_word", list_sizes[i], bench_search_find, &search);
+		search.query = "ургант жди";
+		report("search_find_rare", list_sizes[i], bench_search_find, &search);
+		search.query = "ё";
+		report("search_find_short", list_sizes[i], bench_search_find, &search);
+		search.query = "шерлок";
+		report("search_find_none", list_sizes[i], bench_search_find, &search);
+		search_free(search.ix);
+	}
+
+	return 0;
+}
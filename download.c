@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "rlog.h"
+#include "http.h"
+#include "provider.h"
+#include "download.h"
+
+enum dl_state {
+	DL_QUEUED,
+	DL_DONE,
+	DL_FAILED
+};
+
+static const char *state_names[] = { "queued", "done", "failed" };
+
+/* signed stream urls expire within minutes, they are resolved when the download starts */
+struct dl_entry {
+	enum dl_state state;
+	char provider[32];
+	int id;
+	int attempts;
+	enum stream_format format;
+	int bitrate;
+	char *url;              /* a stream url of the listing, NULL if resolved */
+};
+
+#define MAX_ATTEMPTS 3
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static struct dl_entry *queue;
+static int queue_count;
+static char dl_dir[PATH_MAX];
+static long dl_max_rate;
+static download_resolver resolve;
+static int dl_start_hour;
+static int dl_end_hour;
+static char last_error[4096];
+
+static void
+load_queue()
+{
+	char fname[PATH_MAX];
+	char line[8192];
+	char state[16], provider[32], url[8000];
+	int i, id, format, bitrate;
+	FILE *f;
+
+	snprintf(fname, PATH_MAX-1, "%squeue.txt", dl_dir);
+	f = fopen(fname, "rt");
+	if (f == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "%15s %31s %d %d %d %7999s", state, provider, &id,
+			   &format, &bitrate, url) != 6) {
+			/* queued with its url before they were resolved at the start */
+			format = bitrate = 0;
+			if (sscanf(line, "%15s %31s %d %7999s", state, provider, &id, url) != 4)
+				continue;
+		}
+
+		struct dl_entry *e;
+		queue = realloc(queue, sizeof(struct dl_entry) * (queue_count + 1));
+		e = &queue[queue_count++];
+		memset(e, 0, sizeof(struct dl_entry));
+
+		for (i = 0; i < 3; i++)
+			if (strcmp(state, state_names[i]) == 0)
+				e->state = i;
+
+		strcpy(e->provider, provider);
+		e->id = id;
+		e->format = format;
+		e->bitrate = bitrate;
+		e->url = (strcmp(url, "-") != 0) ? strdup(url) : NULL;
+	}
+
+	fclose(f);
+	rlogi("download queue: %d entries", queue_count);
+}
+
+/* called under lock */
+static void
+save_queue()
+{
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX];
+	int i;
+	FILE *f;
+
+	snprintf(fname, PATH_MAX-1, "%squeue.txt", dl_dir);
+	snprintf(tmp, PATH_MAX-1, "%squeue.txt.tmp", dl_dir);
+
+	f = fopen(tmp, "wt");
+	if (f == NULL) {
+		rlogw("cannot save %s", tmp);
+		return;
+	}
+
+	for (i = 0; i < queue_count; i++) {
+		struct dl_entry *e = &queue[i];
+		fprintf(f, "%s %s %d %d %d %s\n", state_names[e->state], e->provider, e->id,
+			e->format, e->bitrate, (e->url != NULL) ? e->url : "-");
+	}
+
+	fclose(f);
+	rename(tmp, fname);
+}
+
+static struct dl_entry *
+find_entry(const char *provider, int id)
+{
+	int i;
+
+	for (i = 0; i < queue_count; i++)
+		if (queue[i].id == id && strcmp(queue[i].provider, provider) == 0)
+			return &queue[i];
+
+	return NULL;
+}
+
+static struct dl_entry *
+next_queued()
+{
+	int i;
+
+	for (i = 0; i < queue_count; i++)
+		if (queue[i].state == DL_QUEUED)
+			return &queue[i];
+
+	return NULL;
+}
+
+/* seconds until downloads are allowed, 0 if they are allowed now */
+static int
+wait_for_window()
+{
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (dl_start_hour == dl_end_hour)
+		return 0;
+
+	localtime_r(&now, &tm);
+	int h = tm.tm_hour;
+	bool inside;
+
+	if (dl_start_hour < dl_end_hour)
+		inside = (h >= dl_start_hour && h < dl_end_hour);
+	else
+		inside = (h >= dl_start_hour || h < dl_end_hour);
+
+	if (inside)
+		return 0;
+
+	int hours = (dl_start_hour - h + 24) % 24;
+	return hours * 3600 - tm.tm_min * 60 - tm.tm_sec;
+}
+
+static void
+resolve_url(const char *base, const char *ref, char *out, size_t size)
+{
+	const char *p;
+	int n;
+
+	if (strstr(ref, "://") != NULL) {
+		snprintf(out, size, "%s", ref);
+		return;
+	}
+
+	if (ref[0] == '/') {
+		p = strstr(base, "://");
+		p = (p != NULL) ? strchr(p + 3, '/') : NULL;
+		n = (p != NULL) ? p - base : (int)strlen(base);
+		snprintf(out, size, "%.*s%s", n, base, ref);
+		return;
+	}
+
+	p = strchr(base, '?');
+	n = (p != NULL) ? p - base : (int)strlen(base);
+	while (n > 0 && base[n-1] != '/')
+		n--;
+
+	snprintf(out, size, "%.*s%s", n, base, ref);
+}
+
+/* download into fname.part resuming from its size, then rename to fname */
+static int
+download_file(const char *url, const char *fname)
+{
+	char part[PATH_MAX];
+	struct stat st;
+	int rc;
+
+	if (stat(fname, &st) == 0)
+		return 0;
+
+	snprintf(part, PATH_MAX-1, "%s.part", fname);
+
+	struct http_opts opts = {
+		.fname = part,
+		.max_rate = dl_max_rate,
+		.error = last_error,
+		.error_size = sizeof(last_error)
+	};
+
+	if (stat(part, &st) == 0)
+		opts.resume_from = st.st_size;
+
+	if (opts.resume_from > 0)
+		rlogi("resume %s from %jd", url, (intmax_t)opts.resume_from);
+
+	rc = http_get(url, &opts);
+	if (rc != 0) {
+		rlogw("download: %s", last_error);
+		return rc;
+	}
+
+	return rename(part, fname);
+}
+
+/* pick the lowest bandwidth variant from the master playlist */
+static int
+select_variant(char *playlist, const char *base, char *out, size_t size)
+{
+	char *line, *save = NULL;
+	long bw, min_bw = -1;
+	bool stream_inf = false;
+
+	for (line = strtok_r(playlist, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+		if (strncmp(line, "#EXT-X-STREAM-INF:", 18) == 0) {
+			const char *p = strstr(line, "BANDWIDTH=");
+			bw = (p != NULL) ? atol(p + 10) : 0;
+			stream_inf = true;
+			continue;
+		}
+
+		if (line[0] == '#' || !stream_inf)
+			continue;
+
+		if (min_bw == -1 || bw < min_bw) {
+			min_bw = bw;
+			resolve_url(base, line, out, size);
+		}
+		stream_inf = false;
+	}
+
+	return (min_bw == -1) ? -1 : 0;
+}
+
+static int
+download_hls(const char *url, const char *dir)
+{
+	char playlist_url[4096];
+	char seg_url[4096];
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX];
+	struct http_buf buf = { 0 };
+	struct http_opts opts = {
+		.buf = &buf,
+		.error = last_error,
+		.error_size = sizeof(last_error)
+	};
+	char *line, *save = NULL;
+	int rc, n = 0;
+	FILE *f;
+
+	mkdir(dir, 0700);
+	snprintf(playlist_url, sizeof(playlist_url), "%s", url);
+
+	rc = http_get(playlist_url, &opts);
+	if (rc != 0)
+		goto out;
+
+	if (strstr(buf.data, "#EXT-X-STREAM-INF") != NULL) {
+		rc = select_variant(buf.data, url, playlist_url, sizeof(playlist_url));
+		http_buf_clean(&buf);
+		if (rc != 0) {
+			snprintf(last_error, sizeof(last_error), "no variants in %s", url);
+			goto out;
+		}
+
+		rc = http_get(playlist_url, &opts);
+		if (rc != 0)
+			goto out;
+	}
+
+	snprintf(tmp, PATH_MAX-1, "%s/index.m3u8.tmp", dir);
+	f = fopen(tmp, "wt");
+	if (f == NULL) {
+		rc = -1;
+		goto out;
+	}
+
+	for (line = strtok_r(buf.data, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+		if (line[0] == '#') {
+			const char *uri = strstr(line, "URI=\"");
+			const char *end = (uri != NULL) ? strchr(uri + 5, '"') : NULL;
+			if (strncmp(line, "#EXT-X-KEY:", 11) == 0 && end != NULL) {
+				/* keys stay remote, make their uri absolute */
+				char key[4096];
+				snprintf(key, sizeof(key), "%.*s", (int)(end - uri - 5), uri + 5);
+				resolve_url(playlist_url, key, seg_url, sizeof(seg_url));
+				fprintf(f, "%.*sURI=\"%s\"%s\n", (int)(uri - line), line, seg_url, end + 1);
+			} else {
+				fprintf(f, "%s\n", line);
+			}
+			continue;
+		}
+
+		resolve_url(playlist_url, line, seg_url, sizeof(seg_url));
+		snprintf(fname, PATH_MAX-1, "%s/%d.ts", dir, n);
+
+		rc = download_file(seg_url, fname);
+		if (rc != 0)
+			break;
+
+		fprintf(f, "%d.ts\n", n++);
+	}
+
+	fclose(f);
+
+	if (rc == 0) {
+		snprintf(fname, PATH_MAX-1, "%s/index.m3u8", dir);
+		rc = rename(tmp, fname);
+		rlogi("hls saved: %s, %d segments", fname, n);
+	}
+
+out:
+	http_buf_clean(&buf);
+	return rc;
+}
+
+/* url of the stream as of now */
+static char *
+entry_url(const struct dl_entry *e)
+{
+	struct movie_entry m = {
+		.id = e->id,
+		.format = e->format,
+		.bitrate = e->bitrate
+	};
+	char *url;
+
+	if (e->url != NULL)
+		return strdup(e->url);
+
+	url = (resolve != NULL) ? resolve(e->provider, &m) : NULL;
+	if (url == NULL)
+		snprintf(last_error, sizeof(last_error), "no stream url for %s-%d", e->provider, e->id);
+
+	return url;
+}
+
+static int
+download_entry(const struct dl_entry *e)
+{
+	char base[PATH_MAX];
+	char fname[PATH_MAX];
+	int rc, tries;
+
+	snprintf(base, PATH_MAX-1, "%s%s-%d", dl_dir, e->provider, e->id);
+	snprintf(fname, PATH_MAX-1, "%s.video", base);
+
+	/* a resumed download outlives its url, it is resolved again once */
+	for (tries = 0; tries < 2; tries++) {
+		char *url = entry_url(e);
+		if (url == NULL)
+			return -1;
+
+		rlogi("download %s to %s", url, base);
+		if (strstr(url, ".m3u8") != NULL)
+			rc = download_hls(url, base);
+		else
+			rc = download_file(url, fname);
+		free(url);
+
+		if (rc != 403 && rc != 410)
+			break;
+	}
+
+	return rc;
+}
+
+/* download next queued entry. Returns -1 if queue is empty */
+static int
+process_next()
+{
+	struct dl_entry copy;
+	int rc;
+
+	pthread_mutex_lock(&lock);
+	struct dl_entry *e = next_queued();
+	if (e == NULL) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	copy = *e;
+	copy.url = (e->url != NULL) ? strdup(e->url) : NULL;
+	pthread_mutex_unlock(&lock);
+
+	rc = download_entry(&copy);
+	free(copy.url);
+
+	pthread_mutex_lock(&lock);
+	e = find_entry(copy.provider, copy.id);
+	if (e != NULL) {
+		if (rc == 0)
+			e->state = DL_DONE;
+		else if (++e->attempts >= MAX_ATTEMPTS)
+			e->state = DL_FAILED;
+		save_queue();
+	}
+	pthread_mutex_unlock(&lock);
+
+	return (rc == 0) ? 0 : 1;
+}
+
+static void *
+worker(void *arg)
+{
+	int secs;
+
+	while (true) {
+		pthread_mutex_lock(&lock);
+		while (next_queued() == NULL)
+			pthread_cond_wait(&queued, &lock);
+		pthread_mutex_unlock(&lock);
+
+		secs = wait_for_window();
+		if (secs > 0) {
+			rlogi("downloads postponed for %d sec", secs);
+			sleep(secs);
+			continue;
+		}
+
+		/* give the link some time before the next attempt */
+		if (process_next() > 0)
+			sleep(60);
+	}
+
+	return NULL;
+}
+
+void
+download_init(const char *dir, long max_rate, download_resolver resolver)
+{
+	snprintf(dl_dir, PATH_MAX-1, "%s", dir);
+	mkdir(dl_dir, 0700);
+	dl_max_rate = max_rate;
+	resolve = resolver;
+	load_queue();
+}
+
+void
+download_start(int start_hour, int end_hour)
+{
+	pthread_t th;
+
+	dl_start_hour = start_hour;
+	dl_end_hour = end_hour;
+
+	if (pthread_create(&th, NULL, worker, NULL) != 0) {
+		rlogw("cannot start download worker");
+		return;
+	}
+
+	pthread_detach(th);
+}
+
+void
+download_run()
+{
+	while (process_next() != -1)
+		;
+}
+
+int
+download_queue(const char *provider, const struct movie_entry *m)
+{
+	int id = m->id;
+
+	pthread_mutex_lock(&lock);
+
+	struct dl_entry *e = find_entry(provider, id);
+	if (e == NULL) {
+		queue = realloc(queue, sizeof(struct dl_entry) * (queue_count + 1));
+		e = &queue[queue_count++];
+		memset(e, 0, sizeof(struct dl_entry));
+		snprintf(e->provider, sizeof(e->provider), "%s", provider);
+		e->id = id;
+	} else if (e->state != DL_FAILED) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	free(e->url);
+	e->url = (m->stream_url != NULL) ? strdup(m->stream_url) : NULL;
+	e->format = m->format;
+	e->bitrate = m->bitrate;
+	e->state = DL_QUEUED;
+	e->attempts = 0;
+
+	save_queue();
+	pthread_cond_signal(&queued);
+	pthread_mutex_unlock(&lock);
+
+	rlogi("queued %s-%d", provider, id);
+	return 0;
+}
+
+char *
+download_local_path(const char *provider, int id)
+{
+	char fname[PATH_MAX];
+
+	snprintf(fname, PATH_MAX-1, "%s%s-%d.video", dl_dir, provider, id);
+	if (access(fname, R_OK) == 0)
+		return strdup(fname);
+
+	snprintf(fname, PATH_MAX-1, "%s%s-%d/index.m3u8", dl_dir, provider, id);
+	if (access(fname, R_OK) == 0)
+		return strdup(fname);
+
+	return NULL;
+}
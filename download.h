@@ -0,0 +1,26 @@
+/*
+ * Offline downloads. Queue is kept in dir/queue.txt and survives restarts.
+ * Interrupted files are resumed with http ranges, hls streams are saved
+ * as segments with a local playlist.
+ */
+
+struct movie_entry;
+
+/* stream url of the movie of the provider when its download starts, NULL if unknown */
+typedef char *(*download_resolver)(const char *provider, struct movie_entry *m);
+
+/* load the queue. max_rate is in bytes per second, 0 is unlimited */
+void download_init(const char *dir, long max_rate, download_resolver resolver);
+
+/* start background worker. Downloads run only between start_hour and
+ * end_hour (local time). If start_hour == end_hour they run at any time. */
+void download_start(int start_hour, int end_hour);
+
+/* download all queued entries in the current thread and return */
+void download_run();
+
+/* add the movie to the queue, its stream url is resolved when the download starts */
+int download_queue(const char *provider, const struct movie_entry *m);
+
+/* path to the complete local copy or NULL. Must be freed. */
+char *download_local_path(const char *provider, int id);
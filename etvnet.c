@@ -2,19 +2,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <json-c/json.h>
 #include <sys/stat.h>
 #include "common/net.h"
-#include "common/log.h"
+#include "rlog.h"
 #include "common/fs.h"
 #include "provider.h"
+#include "pack.h"
+#include "http.h"
+#include "metrics.h"
+#include "trace.h"
 #include "etvnet.h"
 
 static const char client_id[] = "a332b9d61df7254dffdc81a260373f25592c94c9";
 static const char client_secret[] = "744a52aff20ec13f53bcfd705fc4b79195265497";
 static const char token_url[] = "https://accounts.etvnet.com/auth/oauth/token";
 static const char code_url[] = "https://accounts.etvnet.com/auth/oauth/device/code";
-static const char api_root[] = "https://secure.etvnet.com/api/v3.0/";
+static const char *api_root = "https://secure.etvnet.com/api/v3.0/";  /* CTV_ETVNET_API overrides */
 static const char scope_encoded[] =
 	"com.etvnet.media.browse%20"
 	"com.etvnet.media.watch%20"
@@ -26,9 +34,47 @@ static const char scope_encoded[] =
 	"com.etvnet.persons%20"
 	"com.etvnet.notifications";
 
-static char *cache_path;
+#define REFRESH_AHEAD 300      /* seconds before the token expires */
+#define REFRESH_RETRY 60
+#define STREAM_MARGIN 300      /* stream urls are not handed out closer to expiry */
+#define PER_PAGE 20
+#define MAX_PAGES 100          /* of one list */
+#define SPECULATIVE_PAGES 3    /* requested at once while the page count is unknown */
+#define MAX_PARALLEL 6         /* page requests in flight */
+#define MAX_FOLDERS 32
+#define MAX_QUEUED 256         /* series waiting for their parts index */
+#define PARTS_EXPIRES (30*24*3600)
+#define PARTS_IDLE_MS 1000     /* indexing waits for a pause in user requests */
+
+enum resource {
+	R_FOLDERS,
+	R_BOOKMARKS,
+	R_CHILDREN,
+	R_PARTS,
+	R_STREAM
+};
+
+/* seconds responses are kept, failures are remembered for negative_ttl */
+static const struct policy {
+	int ttl;
+	int negative_ttl;
+} policies[] = {
+	[R_FOLDERS]   = { 3*24*3600, 60 },
+	[R_BOOKMARKS] = { 6*3600, 60 },
+	[R_CHILDREN]  = { 24*3600, 60 },
+	[R_PARTS]     = { 0, 60 },     /* pages of a parts index, only the index is kept */
+	[R_STREAM]    = { 10*60, 15 },
+};
+
+/* tokens are replaced by the refresher thread, access under token_lock */
+static pthread_mutex_t token_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t token_cond = PTHREAD_COND_INITIALIZER;  /* new token or refresh done */
 static char *access_token;
 static char *refresh_token;
+static time_t token_expires;    /* 0 if unknown */
+static time_t token_lifetime;
+static int token_generation;    /* bumped by every new token */
+static bool refreshing;
 static char last_error[4096];
 static struct provider *provider;
 
@@ -40,25 +86,57 @@ etvnet_error()
 	return (provider->error_number > 0) ? last_error : NULL;
 }
 
+/* json response to fname. A broken or truncated body never replaces the file. */
 static int
 fetch(const char *url, const char *fname)
 {
+	char tmp[PATH_MAX];
+	json_object *root;
+
+	snprintf(tmp, PATH_MAX-1, "%s.tmp", fname);
+
 	struct httpreq_opts opts = {
-		.resp_fname = fname,
+		.resp_fname = tmp,
 		.error = last_error,
 		.error_size = 4095
 	};
 
+	uint64_t start = metrics_now();
+	trace_begin("fetch");
 	int rc = httpreq(url, NULL, &opts);
-	return rc;
+	trace_end("fetch");
+	metrics_since(H_FETCH, start);
+
+	if (rc != 0) {
+		unlink(tmp);
+		return rc;
+	}
+
+	root = json_object_from_file(tmp);
+	if (root == NULL) {
+		snprintf(last_error, 4095, "bad json from %s", url);
+		unlink(tmp);
+		return -1;
+	}
+	json_object_put(root);
+
+	return rename(tmp, fname);
 }
 
-static void
+/* returns generation of the token in the url */
+static int
 get_full_url(const char *url, char *full_url)
 {
+	int generation;
+
+	pthread_mutex_lock(&token_lock);
 	strcpy(full_url, url);
 	strcat(full_url, "&access_token=");
-	strcat(full_url, access_token);
+	strcat(full_url, access_token != NULL ? access_token : "");
+	generation = token_generation;
+	pthread_mutex_unlock(&token_lock);
+
+	return generation;
 }
 
 static const char *
@@ -71,308 +149,1778 @@ get_str(json_object *obj, const char *name)
 	if (jres == FALSE)
 		return NULL;
 
-	const char *str = json_object_get_string(child_obj);
-	return str;
+	const char *str = json_object_get_string(child_obj);
+	return str;
+}
+
+static int
+get_int(json_object *obj, const char *name)
+{
+	json_object *child_obj;
+	json_bool jres;
+
+	jres = json_object_object_get_ex(obj, name, &child_obj);
+	if (jres == FALSE)
+		return -1;
+
+	return json_object_get_int(child_obj);
+}
+
+static void
+token_request_url(const char *device_code, const char *refresh, char *url)
+{
+	strcpy(url, token_url);
+	strcat(url, "?client_id=");
+	strcat(url, client_id);
+	strcat(url, "&client_secret=");
+	strcat(url, client_secret);
+	strcat(url, "&scope=");
+	strcat(url, scope_encoded);
+
+	if (device_code != NULL) {
+		strcat(url, "&grant_type=http%3A%2F%2Foauth.net%2Fgrant_type%2Fdevice%2F1.0");
+		strcat(url, "&code=");
+		strcat(url, device_code);
+
+	} else {
+		strcat(url, "&grant_type=refresh_token");
+		strcat(url, "&refresh_token=");
+		strcat(url, refresh);
+	}
+}
+
+/* parse the token file and make its tokens current */
+static int
+read_token(const char *fname, char *error, size_t error_size)
+{
+	struct stat st;
+	const char *access, *refresh, *v;
+	json_object *root;
+
+	if (stat(fname, &st) != 0) {
+		snprintf(error, error_size, "no token file");
+		return -1;
+	}
+
+	root = json_object_from_file(fname);
+	if (root == NULL) {
+		snprintf(error, error_size, "bad token json");
+		return -1;
+	}
+
+	v = get_str(root, "error");
+	if (v != NULL) {
+		snprintf(error, error_size, "token error: %s", v);
+		json_object_put(root);
+		return -1;
+	}
+
+	access = get_str(root, "access_token");
+	if (access == NULL) {
+		snprintf(error, error_size, "bad access token");
+		json_object_put(root);
+		return -1;
+	}
+
+	refresh = get_str(root, "refresh_token");
+	if (refresh == NULL) {
+		snprintf(error, error_size, "bad refresh token");
+		json_object_put(root);
+		return -1;
+	}
+
+	int expires_in = get_int(root, "expires_in");
+
+	pthread_mutex_lock(&token_lock);
+	free(access_token);
+	free(refresh_token);
+	access_token = strdup(access);
+	refresh_token = strdup(refresh);
+	/* counted from the time the token was written */
+	token_lifetime = (expires_in > 0) ? expires_in : 0;
+	token_expires = (expires_in > 0) ? st.st_mtime + expires_in : 0;
+	token_generation++;
+	pthread_cond_broadcast(&token_cond);
+	pthread_mutex_unlock(&token_lock);
+
+	json_object_put(root);
+	return 0;
+}
+
+/*
+ * Refresh the token seen by the caller. Only one refresh runs at a time,
+ * callers that saw the same token wait for it and reuse its result.
+ */
+static int
+refresh_tokens(int seen)
+{
+	char url[1000];
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX];
+	char error[4096] = "";
+	int rc;
+
+	pthread_mutex_lock(&token_lock);
+	while (refreshing)
+		pthread_cond_wait(&token_cond, &token_lock);
+
+	if (token_generation != seen) {
+		pthread_mutex_unlock(&token_lock);
+		return 0;
+	}
+
+	if (refresh_token == NULL) {
+		pthread_mutex_unlock(&token_lock);
+		return -1;
+	}
+
+	refreshing = true;
+	token_request_url(NULL, refresh_token, url);
+	pthread_mutex_unlock(&token_lock);
+
+	/* an error response must not replace the working token file */
+	snprintf(fname, PATH_MAX-1, "%s/.local/etvcc/token.json", getenv("HOME"));
+	snprintf(tmp, PATH_MAX-1, "%s.tmp", fname);
+
+	struct http_opts opts = {
+		.fname = tmp,
+		.deadline_ms = PROVIDER_DEADLINE_MS,
+		.retries = PROVIDER_RETRIES,
+		.error = error,
+		.error_size = sizeof(error)
+	};
+
+	trace_begin("refresh_token");
+	rc = http_get(url, &opts);
+	if (rc == 0)
+		rc = read_token(tmp, error, sizeof(error));
+	if (rc == 0)
+		rename(tmp, fname);
+	else
+		unlink(tmp);
+	trace_end("refresh_token");
+
+	if (rc != 0)
+		rlogw("token refresh failed: %s", error);
+	else
+		rlogi("token refreshed");
+
+	pthread_mutex_lock(&token_lock);
+	refreshing = false;
+	pthread_cond_broadcast(&token_cond);
+	pthread_mutex_unlock(&token_lock);
+
+	return rc;
+}
+
+/* refresh before the token expires, so no api call sees an expired one */
+static void *
+refresher(void *arg)
+{
+	struct timespec deadline = { 0, 0 };
+	time_t retry = 0;
+	int seen, rc;
+
+	pthread_mutex_lock(&token_lock);
+	for (;;) {
+		if (token_expires == 0) {
+			/* woken up by the first token */
+			deadline.tv_sec = time(NULL) + 3600;
+		} else {
+			time_t ahead = token_lifetime / 2;
+			if (ahead > REFRESH_AHEAD)
+				ahead = REFRESH_AHEAD;
+			deadline.tv_sec = token_expires - ahead;
+			if (deadline.tv_sec < retry)
+				deadline.tv_sec = retry;
+		}
+
+		if (time(NULL) < deadline.tv_sec) {
+			pthread_cond_timedwait(&token_cond, &token_lock, &deadline);
+			continue;
+		}
+
+		seen = token_generation;
+		pthread_mutex_unlock(&token_lock);
+		rc = refresh_tokens(seen);
+		pthread_mutex_lock(&token_lock);
+
+		retry = (rc != 0) ? time(NULL) + REFRESH_RETRY : 0;
+	}
+
+	return NULL;
+}
+
+/* refresh now if the background refresh is late */
+static void
+ensure_token()
+{
+	int seen;
+	bool expired;
+
+	pthread_mutex_lock(&token_lock);
+	expired = (token_expires != 0 && time(NULL) >= token_expires);
+	seen = token_generation;
+	pthread_mutex_unlock(&token_lock);
+
+	if (expired)
+		refresh_tokens(seen);
+}
+
+static void
+authorize(const char *device_code)
+{
+	char url[1000];
+	char fname[PATH_MAX];
+	int rc;
+
+	/* create .local dir */
+
+	snprintf(fname, PATH_MAX-1, "%s/.local", getenv("HOME"));
+	if (!exists(fname)) {
+		rc = mkdir(fname, 0700);
+		sprintf(last_error, "cannot create dir %s. Error: %d", fname, rc);
+		provider->error_number = 1;
+		return;
+	}
+
+	snprintf(fname, PATH_MAX-1, "%s/.local/etvcc", getenv("HOME"));
+	if (!exists(fname)) {
+		rc = mkdir(fname, 0700);
+		sprintf(last_error, "cannot create dir %s. Error: %d", fname, rc);
+		provider->error_number = 1;
+		return;
+	}
+
+	if (device_code == NULL) {
+		pthread_mutex_lock(&token_lock);
+		int seen = token_generation;
+		pthread_mutex_unlock(&token_lock);
+
+		if (refresh_tokens(seen) != 0) {
+			sprintf(last_error, "cannot refresh token");
+			provider->error_number = 1;
+		}
+		return;
+	}
+
+	/* fetch tokens */
+
+	token_request_url(device_code, NULL, url);
+
+	snprintf(fname, PATH_MAX-1, "%s/.local/etvcc/token.json", getenv("HOME"));
+	rc = fetch(url, fname);
+
+	if (rc != 0) {
+		provider->error_number = 1;
+		return;
+	}
+
+	init();
+}
+
+static json_object *
+parse_json(const char *data)
+{
+	json_object *root = NULL;
+	uint64_t start = metrics_now();
+
+	if (data != NULL)
+		root = json_tokener_parse(data);
+
+	metrics_since(H_JSON_PARSE, start);
+
+	return root;
+}
+
+/* expiry time of the signed url from its query, 0 if it has none */
+static time_t
+url_expiry(const char *url)
+{
+	static const char *keys[] = { "expires=", "expire=", "exp=", "e=", "valid_to=" };
+	const char *q = (url != NULL) ? strchr(url, '?') : NULL;
+	const char *p;
+	int i;
+
+	if (q == NULL)
+		return 0;
+
+	for (i = 0; i < (int)(sizeof(keys) / sizeof(keys[0])); i++) {
+		for (p = strstr(q, keys[i]); p != NULL; p = strstr(p + 1, keys[i])) {
+			/* whole parameter, or a field of a token like hdnts=st=..~exp=.. */
+			if (p[-1] != '?' && p[-1] != '&' && p[-1] != '~')
+				continue;
+
+			long long v = atoll(p + strlen(keys[i]));
+			if (v > 1000000000LL)
+				return v;
+		}
+	}
+
+	return 0;
+}
+
+static time_t
+expires_at(enum resource r, json_object *root, long max_age)
+{
+	time_t now = time(NULL);
+	time_t expires = now + policies[r].ttl;
+	json_object *data;
+
+	if (max_age >= 0 && now + max_age < expires)
+		expires = now + max_age;
+
+	if (r == R_STREAM && json_object_object_get_ex(root, "data", &data)) {
+		time_t url_expires = url_expiry(get_str(data, "url"));
+		if (url_expires != 0 && url_expires - STREAM_MARGIN < expires)
+			expires = url_expires - STREAM_MARGIN;
+	}
+
+	return expires;
+}
+
+/* lets a caller that has parsed a page skip the same page */
+struct body_check {
+	unsigned known;         /* fingerprint of the body the caller has, 0 if none */
+	unsigned fingerprint;   /* of the body seen */
+	bool unchanged;         /* it was the known one and was not parsed */
+};
+
+static unsigned
+fingerprint(const char *data, size_t len)
+{
+	unsigned h = pack_hash(data, len);
+
+	return (h != 0) ? h : 1;
+}
+
+static bool
+same_body(struct body_check *check, const char *data, size_t len)
+{
+	if (check == NULL)
+		return false;
+
+	check->fingerprint = fingerprint(data, len);
+	check->unchanged = (check->fingerprint == check->known);
+
+	return check->unchanged;
+}
+
+/*
+ * Fetch and parse the json, good responses are kept in the pack under the
+ * name for as long as the policy and the response allow. rc is the http
+ * result, 401 for an api error about the token too. NULL with rc 0 is
+ * another api error, a bad body or a body the check knows.
+ */
+static json_object *
+fetch_json(const char *url, const char *name, enum resource r, int *rc,
+	   struct body_check *check, char *error, size_t error_size)
+{
+	struct http_buf buf = { 0 };
+	struct http_opts opts = {
+		.buf = &buf,
+		.deadline_ms = PROVIDER_DEADLINE_MS,
+		.retries = PROVIDER_RETRIES,
+		.hedge = true,
+		.error = error,
+		.error_size = error_size
+	};
+	json_object *root;
+	const char *api_error;
+
+	*rc = http_get(url, &opts);
+	if (*rc != 0)
+		return NULL;
+
+	/* the same bytes were validated when first seen */
+	if (same_body(check, buf.data, buf.len)) {
+		time_t expires = expires_at(r, NULL, opts.max_age);
+		if (expires > time(NULL))
+			pack_put(name, buf.data, buf.len, expires);
+		http_buf_clean(&buf);
+		return NULL;
+	}
+
+	root = parse_json(buf.data);
+	api_error = get_str(root, "error");
+
+	if (root == NULL || api_error != NULL) {
+		/* invalid_token, expired_token and the like */
+		if (api_error != NULL && strstr(api_error, "token") != NULL)
+			*rc = 401;
+		if (api_error != NULL)
+			snprintf(error, error_size, "api error: %s", api_error);
+		else
+			snprintf(error, error_size, "cannot load %s", name);
+		json_object_put(root);
+		http_buf_clean(&buf);
+		return NULL;
+	}
+
+	time_t expires = expires_at(r, root, opts.max_age);
+	if (expires > time(NULL))
+		pack_put(name, buf.data, buf.len, expires);
+
+	http_buf_clean(&buf);
+	return root;
+}
+
+/* cached or fetched json, NULL with the reason in error or the known body unchanged */
+static json_object *
+load_cached(const char *url, const char *name, enum resource r, struct body_check *check,
+	    char *error, size_t error_size)
+{
+	char full_url[500];
+	char negative[120];
+	struct http_buf buf = { 0 };
+	int rc, seen;
+	json_object *root;
+	char *msg;
+
+	/* a refresh asks the server, the cached copy is the known body itself */
+	if (check == NULL || check->known == 0) {
+		buf.data = pack_get(name, &buf.len);
+		metrics_count(buf.data != NULL ? C_CACHE_HIT : C_CACHE_MISS, 1);
+	}
+
+	if (buf.data != NULL) {
+		if (check != NULL)
+			check->fingerprint = fingerprint(buf.data, buf.len);
+
+		root = parse_json(buf.data);
+		http_buf_clean(&buf);
+		if (root != NULL && get_str(root, "error") == NULL)
+			return root;
+
+		/* stored error response, fetch again */
+		json_object_put(root);
+		pack_remove(name);
+	}
+
+	/* failed a moment ago, do not hammer the api */
+	snprintf(negative, sizeof(negative), "failed-%s", name);
+	msg = pack_get(negative, NULL);
+	if (msg != NULL) {
+		snprintf(error, error_size, "%s", msg);
+		free(msg);
+		return NULL;
+	}
+
+	ensure_token();
+	seen = get_full_url(url, full_url);
+	root = fetch_json(full_url, name, r, &rc, check, error, error_size);
+	if (root != NULL || (check != NULL && check->unchanged))
+		return root;
+
+	if (rc == 401) {
+		/* token revoked or expired early, refetch with the refreshed one */
+		if (refresh_tokens(seen) != 0) {
+			snprintf(error, error_size, "cannot refresh token");
+			return NULL;
+		}
+
+		get_full_url(url, full_url);
+		root = fetch_json(full_url, name, r, &rc, check, error, error_size);
+		if (root != NULL || (check != NULL && check->unchanged))
+			return root;
+	}
+
+	pack_put(negative, error, strlen(error), time(NULL) + policies[r].negative_ttl);
+	return NULL;
+}
+
+static json_object *
+get_cached(const char *url, const char *name, enum resource r)
+{
+	trace_begin("get_cached");
+	json_object *root = load_cached(url, name, r, NULL, last_error, sizeof(last_error));
+	if (root == NULL)
+		provider->error_number = 1;
+	trace_end("get_cached");
+
+	return root;
+}
+
+/*
+ * List fetched page by page, the page is appended to url and name. Pages
+ * are fingerprinted, fetching again leaves the roots of unchanged pages NULL.
+ */
+struct paged {
+	char url[400];
+	char name[80];
+	enum resource r;
+	const char *array;      /* of entries in data */
+	int known_pages;        /* from the pagination of the response, 0 if unknown */
+	int count;
+	json_object *roots[MAX_PAGES];
+	unsigned fingerprints[MAX_PAGES];
+	int sizes[MAX_PAGES];   /* entries of the pages */
+	int kept[MAX_PAGES];    /* tab entries from the pages, duplicates dropped */
+	int prev_count;         /* pages and kept entries of the fetch before */
+	int prev_kept[MAX_PAGES];
+	bool done;
+	bool failed;            /* a page that exists could not be fetched */
+};
+
+struct page_job {
+	struct paged *list;
+	int page;
+	json_object *root;
+	struct body_check check;
+	char error[256];
+};
+
+/* page requests are run by a pool of long lived workers */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct page_job *pool_jobs;
+static int pool_count;
+static int pool_next;
+static int pool_finished;
+static bool pool_started;
+
+static void
+fetch_page(struct page_job *j)
+{
+	char url[500];
+	char name[100];
+
+	/* first pages keep the urls and pack names of single page lists */
+	if (j->page == 1) {
+		snprintf(url, sizeof(url), "%s", j->list->url);
+		snprintf(name, sizeof(name), "%s", j->list->name);
+	} else {
+		snprintf(url, sizeof(url), "%s&page=%d", j->list->url, j->page);
+		snprintf(name, sizeof(name), "%s-%d", j->list->name, j->page);
+	}
+
+	j->check.known = j->list->fingerprints[j->page - 1];
+	j->root = load_cached(url, name, j->list->r, &j->check, j->error, sizeof(j->error));
+}
+
+static void *
+page_worker(void *arg)
+{
+	struct page_job *j;
+
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_next >= pool_count)
+			pthread_cond_wait(&pool_work, &pool_lock);
+
+		j = &pool_jobs[pool_next++];
+		pthread_mutex_unlock(&pool_lock);
+
+		fetch_page(j);
+
+		pthread_mutex_lock(&pool_lock);
+		if (++pool_finished == pool_count)
+			pthread_cond_signal(&pool_done);
+	}
+
+	return NULL;
+}
+
+static void
+run_jobs(struct page_job *jobs, int count)
+{
+	pthread_t tid;
+	int i;
+
+	pthread_mutex_lock(&pool_run_lock);
+	pthread_mutex_lock(&pool_lock);
+
+	if (!pool_started) {
+		for (i = 0; i < MAX_PARALLEL; i++) {
+			pthread_create(&tid, NULL, page_worker, NULL);
+			pthread_detach(tid);
+		}
+		pool_started = true;
+	}
+
+	pool_jobs = jobs;
+	pool_count = count;
+	pool_next = 0;
+	pool_finished = 0;
+	pthread_cond_broadcast(&pool_work);
+
+	while (pool_finished < pool_count)
+		pthread_cond_wait(&pool_done, &pool_lock);
+
+	pool_jobs = NULL;
+	pool_count = 0;
+	pool_next = 0;
+
+	pthread_mutex_unlock(&pool_lock);
+	pthread_mutex_unlock(&pool_run_lock);
+}
+
+static json_object *
+page_entries(json_object *root, const char *array)
+{
+	json_object *data, *obj;
+
+	if (!json_object_object_get_ex(root, "data", &data) ||
+	    !json_object_object_get_ex(data, array, &obj))
+		return NULL;
+
+	return obj;
+}
+
+static int
+page_total(json_object *root)
+{
+	json_object *data, *pagination;
+
+	if (!json_object_object_get_ex(root, "data", &data) ||
+	    !json_object_object_get_ex(data, "pagination", &pagination))
+		return 0;
+
+	return get_int(pagination, "pages");
+}
+
+/*
+ * All pages of the lists. First pages of all lists are requested together,
+ * then the rest of the pages, or batches of them while the count is
+ * unknown. A missing page after the first ends the list. Runs on any
+ * thread, the first failure is left in error.
+ */
+static int
+fetch_paged(struct paged *lists, int n, char *error, size_t error_size)
+{
+	struct page_job *jobs = NULL;
+	int count, capacity = 0, i, p, rc = 0;
+
+	for (;;) {
+		count = 0;
+
+		for (i = 0; i < n; i++) {
+			struct paged *l = &lists[i];
+			int last = l->count + ((l->count == 0) ? 1 : SPECULATIVE_PAGES);
+
+			if (l->known_pages > 0)
+				last = l->known_pages;
+			if (last > MAX_PAGES)
+				last = MAX_PAGES;
+			if (l->count >= last)
+				l->done = true;
+			if (l->done)
+				continue;
+
+			for (p = l->count + 1; p <= last; p++) {
+				if (count == capacity) {
+					capacity = (capacity == 0) ? 16 : capacity * 2;
+					jobs = realloc(jobs, sizeof(struct page_job) * capacity);
+				}
+				jobs[count++] = (struct page_job){ .list = l, .page = p };
+			}
+		}
+
+		if (count == 0)
+			break;
+
+		/* a round at a time, so lists of other threads are not stuck behind */
+		for (i = 0; i < count; i += MAX_PARALLEL)
+			run_jobs(jobs + i, (count - i < MAX_PARALLEL) ? count - i : MAX_PARALLEL);
+
+		/* jobs are in the order of lists and pages */
+		for (i = 0; i < count; i++) {
+			struct page_job *j = &jobs[i];
+			struct paged *l = j->list;
+
+			if (l->done) {
+				json_object_put(j->root);
+				continue;
+			}
+
+			if (j->root == NULL && !j->check.unchanged) {
+				if (j->page == 1 || j->page <= l->known_pages) {
+					if (rc == 0)
+						snprintf(error, error_size, "%s", j->error);
+					l->failed = true;
+					rc = -1;
+				}
+				l->done = true;
+				continue;
+			}
+
+			/* an unchanged page keeps its size and the page count it gave */
+			if (j->root != NULL) {
+				json_object *entries = page_entries(j->root, l->array);
+				l->sizes[l->count] = (entries != NULL) ? json_object_array_length(entries) : 0;
+				if (j->page == 1 && page_total(j->root) > 0)
+					l->known_pages = page_total(j->root);
+			}
+
+			l->roots[l->count] = j->root;
+			l->fingerprints[l->count] = j->check.fingerprint;
+			if (l->sizes[l->count++] < PER_PAGE)
+				l->done = true;
+		}
+	}
+
+	free(jobs);
+
+	/* speculative requests past the end failed, they are not errors */
+	return rc;
+}
+
+static void
+paged_release(struct paged *l)
+{
+	int i;
+
+	for (i = 0; i < l->count; i++) {
+		json_object_put(l->roots[i]);
+		l->roots[i] = NULL;
+	}
+}
+
+/* before fetching the list again, fingerprints and sizes stay to compare */
+static void
+paged_reset(struct paged *l)
+{
+	int i;
+
+	paged_release(l);
+
+	/* a failed fetch left them half updated, all pages count as changed */
+	if (l->failed)
+		l->count = 0;
+
+	for (i = l->count; i < MAX_PAGES; i++)
+		l->fingerprints[i] = 0;
+
+	l->prev_count = l->count;
+	memcpy(l->prev_kept, l->kept, sizeof(l->kept));
+	l->count = 0;
+	l->done = false;
+	l->failed = false;
+}
+
+void
+etvnet_set_lowest_bitrate(json_object *files, struct movie_entry *e)
+{
+	json_object *file;
+	int i, files_count = json_object_array_length(files);
+	bool has_mp4 = false;
+	bool has_wmv = false;
+
+	for (i = 0; i < files_count; i++) {
+		file = json_object_array_get_idx(files, i);
+		int bitrate = get_int(file, "bitrate");
+		const char *format = get_str(file, "format");
+
+		if (strcmp(format, "mp4") == 0 && bitrate == 400) {
+			has_mp4 = true;
+			break;
+		}
+		else if (strcmp(format, "wmv") == 0 && bitrate == 600) {
+			has_wmv = true;
+		}
+	}
+
+	if (has_mp4) {
+		e->format = SF_MP4;
+		e->bitrate = 400;
+	} else if (has_wmv) {
+		e->format = SF_WMV;
+		e->bitrate = 600;
+	}
+}
+
+struct movie_entry *
+etvnet_create_movie(json_object *obj)
+{
+	json_object *files;
+	json_bool jres;
+
+	trace_begin("create_movie");
+	struct movie_entry *e = calloc(1, sizeof(struct movie_entry));
+
+	e->id = get_int(obj, "id");
+	e->children_count = get_int(obj, "children_count");
+	e->name = strdup(get_str(obj, "name"));
+	e->description = strdup(get_str(obj, "description"));
+	e->on_air = strdup(get_str(obj, "on_air"));
+
+	jres = json_object_object_get_ex(obj, "files", &files);
+	if (jres)
+		etvnet_set_lowest_bitrate(files, e);
+
+	rlogd("id: %d, name: %s, format: %d, bitrate: %d", e->id, e->name, e->format, e->bitrate);
+	trace_end("create_movie");
+
+	return e;
+}
+
+static json_object *
+get_data(json_object *root, const char *name)
+{
+	json_object *data, *obj;
+	json_bool jres;
+
+	jres = json_object_object_get_ex(root, "data", &data);
+	if (jres == FALSE) {
+		sprintf(last_error, "Cannot get data for %s", name);
+		provider->error_number = 1;
+		return  NULL;
+	}
+
+	jres = json_object_object_get_ex(data, name, &obj);
+	if (jres == FALSE) {
+		sprintf(last_error, "Cannot get data/%s", name);
+		provider->error_number = 1;
+		return NULL;
+	}
+
+	return obj;
+}
+
+static int
+append_favorites(struct movie_list *list, json_object *root, char *error, size_t error_size)
+{
+	json_object *bookmarks, *bookmark;
+	int i, bookmarks_count;
+
+	int status = get_int(root, "status_code");
+	if (status != 200) {
+		snprintf(error, error_size, "invalid status %d", status);
+		return -1;
+	}
+
+	bookmarks = page_entries(root, "bookmarks");
+	bookmarks_count = json_object_array_length(bookmarks);
+
+	for (i = 0; i < bookmarks_count; i++) {
+		bookmark = json_object_array_get_idx(bookmarks, i);
+		if (bookmark == NULL) {
+			snprintf(error, error_size, "Cannot get bookmark[%d]", i);
+			return -1;
+		}
+
+		struct movie_entry *e = etvnet_create_movie(bookmark);
+		append_movie(list, e);
+	}
+
+	return 0;
+}
+
+/*
+ * Parts of every series with children, built in the background from all
+ * pages of its children and kept in the pack as "parts-<id>": a header
+ * line "<count> <checked>" and one
+ * "id\ton_air\tduration\tformat\tbitrate\tname\tdescription" line per part,
+ * in on_air order. Like a listed entry, a part keeps only the format
+ * chosen by etvnet_set_lowest_bitrate.
+ */
+struct part {
+	int id;
+	int duration;
+	int bitrate;
+	enum stream_format format;
+	char *on_air;
+	char *name;
+	char *description;
+};
+
+struct parts_index {
+	int parent_id;
+	int count;
+	time_t checked;
+	struct part *items;
+	struct parts_index *next;
+};
+
+struct queued_series {
+	int id;
+	int children_count;
+};
+
+static pthread_mutex_t parts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parts_cond = PTHREAD_COND_INITIALIZER;  /* series queued */
+static struct parts_index *parts;
+static struct queued_series parts_queue[MAX_QUEUED];
+static int parts_queued;
+static uint64_t user_request_at;  /* of the last load or part request */
+
+static void
+user_request()
+{
+	pthread_mutex_lock(&parts_lock);
+	user_request_at = metrics_now();
+	pthread_mutex_unlock(&parts_lock);
+}
+
+static void
+parts_free(struct parts_index *ix)
+{
+	int i;
+
+	for (i = 0; i < ix->count; i++) {
+		free(ix->items[i].on_air);
+		free(ix->items[i].name);
+		free(ix->items[i].description);
+	}
+	free(ix->items);
+	free(ix);
+}
+
+static struct parts_index *
+parts_load(int parent_id)
+{
+	struct parts_index *ix;
+	char key[40], *data, *line, *save, *f[7];
+	long long checked;
+	int count, i;
+
+	snprintf(key, sizeof(key), "parts-%d", parent_id);
+	data = pack_get(key, NULL);
+	if (data == NULL)
+		return NULL;
+
+	line = strtok_r(data, "\n", &save);
+	if (line == NULL || sscanf(line, "%d %lld", &count, &checked) != 2 || count <= 0) {
+		free(data);
+		return NULL;
+	}
+
+	ix = calloc(1, sizeof(struct parts_index));
+	ix->parent_id = parent_id;
+	ix->checked = checked;
+	ix->items = calloc(count, sizeof(struct part));
+
+	while ((line = strtok_r(NULL, "\n", &save)) != NULL && ix->count < count) {
+		for (i = 0; i < 7; i++)
+			f[i] = strsep(&line, "\t");
+		if (f[5] == NULL)
+			continue;
+
+		struct part *p = &ix->items[ix->count++];
+		p->id = atoi(f[0]);
+		p->on_air = strdup(f[1]);
+		p->duration = atoi(f[2]);
+		p->format = atoi(f[3]);
+		p->bitrate = atoi(f[4]);
+		p->name = strdup(f[5]);
+		/* not in indexes saved before descriptions were kept */
+		p->description = strdup(f[6] != NULL ? f[6] : "");
+	}
+
+	free(data);
+	return ix;
+}
+
+static void
+parts_save(struct parts_index *ix)
+{
+	char key[40], *data = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&data, &len);
+	int i;
+
+	fprintf(f, "%d %lld\n", ix->count, (long long)ix->checked);
+	for (i = 0; i < ix->count; i++) {
+		struct part *p = &ix->items[i];
+		fprintf(f, "%d\t%s\t%d\t%d\t%d\t%s\t%s\n", p->id, p->on_air, p->duration,
+			p->format, p->bitrate, p->name, p->description);
+	}
+	fclose(f);
+
+	snprintf(key, sizeof(key), "parts-%d", ix->parent_id);
+	pack_put(key, data, len, time(NULL) + PARTS_EXPIRES);
+	free(data);
+}
+
+/* tabs and newlines would break the index lines */
+static char *
+part_str(const char *s)
+{
+	char *p, *r = strdup(s != NULL ? s : "");
+
+	for (p = r; *p; p++) {
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+			*p = ' ';
+	}
+
+	return r;
+}
+
+static struct parts_index *
+parts_build(int parent_id, int children_count, char *error, size_t error_size)
+{
+	struct paged *l = calloc(1, sizeof(struct paged));
+	struct parts_index *ix = NULL;
+	json_object *children, *child, *files;
+	struct movie_entry e;
+	int i, j, n, total = 0;
+
+	snprintf(l->url, sizeof(l->url), "%s/video/media/%d/children.json?per_page=%d&order_by=on_air",
+		 api_root, parent_id, PER_PAGE);
+	snprintf(l->name, sizeof(l->name), "parts-page-%d", parent_id);
+	l->r = R_PARTS;
+	l->array = "children";
+	l->known_pages = (children_count + PER_PAGE - 1) / PER_PAGE;
+
+	if (fetch_paged(l, 1, error, error_size) != 0)
+		goto out;
+
+	for (i = 0; i < l->count; i++)
+		total += json_object_array_length(page_entries(l->roots[i], "children"));
+	if (total == 0) {
+		snprintf(error, error_size, "no parts of %d", parent_id);
+		goto out;
+	}
+
+	ix = calloc(1, sizeof(struct parts_index));
+	ix->parent_id = parent_id;
+	ix->checked = time(NULL);
+	ix->items = calloc(total, sizeof(struct part));
+
+	for (i = 0; i < l->count; i++) {
+		children = page_entries(l->roots[i], "children");
+		n = json_object_array_length(children);
+
+		for (j = 0; j < n; j++) {
+			child = json_object_array_get_idx(children, j);
+			struct part *p = &ix->items[ix->count++];
+
+			memset(&e, 0, sizeof(e));
+			if (json_object_object_get_ex(child, "files", &files))
+				etvnet_set_lowest_bitrate(files, &e);
+
+			p->id = get_int(child, "id");
+			p->duration = get_int(child, "duration");
+			p->format = e.format;
+			p->bitrate = e.bitrate;
+			p->on_air = part_str(get_str(child, "on_air"));
+			p->name = part_str(get_str(child, "name"));
+			p->description = part_str(get_str(child, "description"));
+		}
+	}
+
+out:
+	paged_release(l);
+	free(l);
+
+	return ix;
+}
+
+/* replaces the index of the same series, callers hold parts_lock */
+static void
+parts_publish(struct parts_index *ix)
+{
+	struct parts_index **p;
+
+	for (p = &parts; *p != NULL; p = &(*p)->next) {
+		if ((*p)->parent_id == ix->parent_id) {
+			struct parts_index *old = *p;
+			ix->next = old->next;
+			*p = ix;
+			parts_free(old);
+			return;
+		}
+	}
+
+	ix->next = parts;
+	parts = ix;
+}
+
+static struct parts_index *
+parts_find(int parent_id)
+{
+	struct parts_index *ix;
+
+	for (ix = parts; ix != NULL; ix = ix->next) {
+		if (ix->parent_id == parent_id)
+			return ix;
+	}
+
+	return NULL;
+}
+
+/* series the user is looking at go first */
+static void
+queue_parts(int parent_id, int children_count, bool urgent)
+{
+	int i;
+
+	pthread_mutex_lock(&parts_lock);
+
+	for (i = 0; i < parts_queued; i++) {
+		if (parts_queue[i].id == parent_id)
+			break;
+	}
+	if (i < parts_queued) {
+		if (parts_queue[i].children_count > children_count)
+			children_count = parts_queue[i].children_count;
+		memmove(&parts_queue[i], &parts_queue[i + 1], sizeof(parts_queue[0]) * (parts_queued - i - 1));
+		parts_queued--;
+	}
+
+	if (parts_queued == MAX_QUEUED) {
+		if (!urgent) {
+			pthread_mutex_unlock(&parts_lock);
+			return;
+		}
+		parts_queued--;
+	}
+
+	struct queued_series q = { parent_id, children_count };
+	if (urgent) {
+		memmove(&parts_queue[1], &parts_queue[0], sizeof(parts_queue[0]) * parts_queued);
+		parts_queue[0] = q;
+	} else {
+		parts_queue[parts_queued] = q;
+	}
+	parts_queued++;
+
+	pthread_cond_signal(&parts_cond);
+	pthread_mutex_unlock(&parts_lock);
+}
+
+static bool
+parts_current(struct parts_index *ix, int children_count)
+{
+	return ix != NULL && ix->count >= children_count &&
+		ix->checked + policies[R_CHILDREN].ttl > time(NULL);
+}
+
+static void *
+indexer(void *arg)
+{
+	struct queued_series q;
+	struct parts_index *ix;
+	char error[256];
+	uint64_t idle;
+	bool current;
+
+	for (;;) {
+		pthread_mutex_lock(&parts_lock);
+		while (parts_queued == 0)
+			pthread_cond_wait(&parts_cond, &parts_lock);
+
+		/* the same hosts serve the user, keep out of the way */
+		idle = metrics_now() - user_request_at;
+		if (idle < PARTS_IDLE_MS * 1000ULL) {
+			pthread_mutex_unlock(&parts_lock);
+			usleep(PARTS_IDLE_MS * 1000ULL - idle);
+			continue;
+		}
+
+		q = parts_queue[0];
+		memmove(&parts_queue[0], &parts_queue[1], sizeof(parts_queue[0]) * (parts_queued - 1));
+		parts_queued--;
+		current = parts_current(parts_find(q.id), q.children_count);
+		pthread_mutex_unlock(&parts_lock);
+
+		if (current)
+			continue;
+
+		/* saved by an earlier run */
+		ix = parts_load(q.id);
+		if (ix != NULL && !parts_current(ix, q.children_count)) {
+			/* stale is still better than nothing while the new one builds */
+			pthread_mutex_lock(&parts_lock);
+			if (parts_find(q.id) == NULL) {
+				parts_publish(ix);
+				ix = NULL;
+			}
+			pthread_mutex_unlock(&parts_lock);
+
+			if (ix != NULL)
+				parts_free(ix);
+			ix = NULL;
+		}
+
+		if (ix == NULL) {
+			uint64_t start = metrics_now();
+			ix = parts_build(q.id, q.children_count, error, sizeof(error));
+			if (ix == NULL) {
+				rlogw("parts of %d: %s", q.id, error);
+				continue;
+			}
+			rlogi("parts of %d: %d in %llu ms", q.id, ix->count,
+			      (unsigned long long)(metrics_now() - start) / 1000);
+			parts_save(ix);
+		}
+
+		pthread_mutex_lock(&parts_lock);
+		parts_publish(ix);
+		pthread_mutex_unlock(&parts_lock);
+	}
+
+	return NULL;
+}
+
+static struct movie_entry *
+part_movie(const struct part *p)
+{
+	struct movie_entry *e = calloc(1, sizeof(struct movie_entry));
+
+	e->id = p->id;
+	e->name = strdup(p->name);
+	e->description = strdup(p->description);
+	e->on_air = strdup(p->on_air);
+	e->duration = p->duration;
+	e->format = p->format;
+	e->bitrate = p->bitrate;
+
+	return e;
+}
+
+/* part from the index, NULL if the series is not indexed that far */
+static struct movie_entry *
+find_movie(int parent_id, int idx)
+{
+	struct parts_index *ix;
+	struct movie_entry *e = NULL;
+
+	pthread_mutex_lock(&parts_lock);
+	ix = parts_find(parent_id);
+	if (ix != NULL && idx >= 0 && idx < ix->count)
+		e = part_movie(&ix->items[idx]);
+	pthread_mutex_unlock(&parts_lock);
+
+	return e;
+}
+
+static void
+queue_series(struct movie_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->items[i]->children_count > 0)
+			queue_parts(list->items[i]->id, list->items[i]->children_count, false);
+	}
 }
 
+/*
+ * Folders of the last load, tabs[i] of favorites shows folder_pages[i].
+ * A fetch reads them, applying its changes replaces them, never both at
+ * once.
+ */
+static struct movie_list *favorites;
+static struct paged *folders_list;
+static struct paged *folder_pages;
+static int folder_ids[MAX_FOLDERS];
+static int folders_count;
+
+/* what a fetch of the favorites found, applied to the tabs where they are shown */
+struct list_changes {
+	char error[256];                    /* the first failure, empty if none */
+	int folders_count;                  /* -1 if the folders are unchanged */
+	int folder_ids[MAX_FOLDERS];
+	char *titles[MAX_FOLDERS];
+	struct paged *pages;                /* of the folders, NULL if they could not be fetched */
+	struct movie_list fresh[MAX_FOLDERS];   /* entries of the changed pages */
+	bool parsed[MAX_FOLDERS][MAX_PAGES];    /* pages in fresh */
+};
+
 static int
-get_int(json_object *obj, const char *name)
+by_id(const void *a, const void *b)
 {
-	json_object *child_obj;
-	json_bool jres;
+	const struct movie_entry *x = *(struct movie_entry * const *)a;
+	const struct movie_entry *y = *(struct movie_entry * const *)b;
 
-	jres = json_object_object_get_ex(obj, name, &child_obj);
-	if (jres == FALSE)
-		return -1;
-
-	return json_object_get_int(child_obj);
+	return (x->id > y->id) - (x->id < y->id);
 }
 
-static void
-authorize(const char *device_code)
+/* slots of a list by the id of their entry, then by the place in the list */
+static int
+by_slot_id(const void *a, const void *b)
 {
-	char url[1000];
-	char fname[PATH_MAX];
-	int rc;
+	struct movie_entry * const *x = *(struct movie_entry * const **)a;
+	struct movie_entry * const *y = *(struct movie_entry * const **)b;
 
-	/* create .local dir */
+	if ((*x)->id != (*y)->id)
+		return ((*x)->id > (*y)->id) - ((*x)->id < (*y)->id);
+	return (x > y) - (x < y);
+}
 
-	snprintf(fname, PATH_MAX-1, "%s/.local", getenv("HOME"));
-	if (!exists(fname)) {
-		rc = mkdir(fname, 0700);
-		sprintf(last_error, "cannot create dir %s. Error: %d", fname, rc);
-		provider->error_number = 1;
-		return;
+static bool
+same_str(const char *a, const char *b)
+{
+	return strcmp(a != NULL ? a : "", b != NULL ? b : "") == 0;
+}
+
+/* moves what changed from the fresh copy into the entry and frees the copy */
+static int
+update_entry(struct movie_entry *e, struct movie_entry *fresh)
+{
+	bool changed = !same_str(e->name, fresh->name) ||
+		!same_str(e->description, fresh->description) ||
+		!same_str(e->on_air, fresh->on_air) ||
+		e->children_count != fresh->children_count ||
+		e->format != fresh->format || e->bitrate != fresh->bitrate;
+
+	if (changed) {
+		char *name = e->name, *description = e->description, *on_air = e->on_air;
+
+		e->name = fresh->name;
+		e->description = fresh->description;
+		e->on_air = fresh->on_air;
+		fresh->name = name;
+		fresh->description = description;
+		fresh->on_air = on_air;
+
+		e->format = fresh->format;
+		e->bitrate = fresh->bitrate;
+		if (e->children_count != fresh->children_count) {
+			e->children_count = fresh->children_count;
+			free(e->part_on_air);
+			e->part_on_air = NULL;
+			if (e->sel >= e->children_count)
+				e->sel = (e->children_count > 0) ? e->children_count - 1 : 0;
+			if (e->children_count > 0)
+				queue_parts(e->id, e->children_count, false);
+		}
 	}
 
-	snprintf(fname, PATH_MAX-1, "%s/.local/etvcc", getenv("HOME"));
-	if (!exists(fname)) {
-		rc = mkdir(fname, 0700);
-		sprintf(last_error, "cannot create dir %s. Error: %d", fname, rc);
-		provider->error_number = 1;
-		return;
+	free_movie(fresh);
+	return changed;
+}
+
+/*
+ * Makes the fresh entries the entries of the tab. Entries that stay keep
+ * their memory and selected part and take the changes, the rest is freed.
+ * The selection stays on the same entry. pages of the fresh entries, if
+ * not NULL, is compacted with them. Returns the number of changes.
+ */
+static int
+merge_entries(struct movie_list *tab, struct movie_list *fresh, int *pages)
+{
+	struct movie_entry **old = malloc(sizeof(struct movie_entry *) * (tab->count + 1));
+	struct movie_entry ***slots = malloc(sizeof(struct movie_entry **) * (fresh->count + 1));
+	bool *kept = calloc(tab->count + 1, sizeof(bool));
+	bool *again = calloc(fresh->count + 1, sizeof(bool));
+	int sel_id = (tab->sel < tab->count) ? tab->items[tab->sel]->id : -1;
+	int i, n = 0, changes = 0;
+
+	memcpy(old, tab->items, sizeof(struct movie_entry *) * tab->count);
+	qsort(old, tab->count, sizeof(struct movie_entry *), by_id);
+
+	/* listed twice, the folder changed between its pages */
+	for (i = 0; i < fresh->count; i++)
+		slots[i] = &fresh->items[i];
+	qsort(slots, fresh->count, sizeof(struct movie_entry **), by_slot_id);
+	for (i = 1; i < fresh->count; i++) {
+		if ((*slots[i])->id == (*slots[i - 1])->id)
+			again[slots[i] - fresh->items] = true;
 	}
 
-	/* fetch tokens */
+	for (i = 0; i < fresh->count; i++) {
+		struct movie_entry *e = fresh->items[i];
+		struct movie_entry **o = bsearch(&e, old, tab->count, sizeof(struct movie_entry *), by_id);
 
-	strcpy(url, token_url);
-	strcat(url, "?client_id=");
-	strcat(url, client_id);
-	strcat(url, "&client_secret=");
-	strcat(url, client_secret);
-	strcat(url, "&scope=");
-	strcat(url, scope_encoded);
+		if (again[i]) {
+			/* the first one took the old entry if there is one */
+			if (o == NULL || (e != *o && kept[o - old]))
+				free_movie(e);
+			continue;
+		}
 
-	if (device_code != NULL) {
-		strcat(url, "&grant_type=http%3A%2F%2Foauth.net%2Fgrant_type%2Fdevice%2F1.0");
-		strcat(url, "&code=");
-		strcat(url, device_code);
+		if (o != NULL) {
+			kept[o - old] = true;
+			if (e != *o)
+				changes += update_entry(*o, e);
+			e = *o;
+		} else {
+			changes++;
+			if (e->children_count > 0)
+				queue_parts(e->id, e->children_count, false);
+		}
 
-	} else {
-		strcat(url, "&grant_type=refresh_token");
-		strcat(url, "&refresh_token=");
-		strcat(url, refresh_token);
+		if (pages != NULL)
+			pages[n] = pages[i];
+		fresh->items[n++] = e;
 	}
 
-	snprintf(fname, PATH_MAX-1, "%s/.local/etvcc/token.json", getenv("HOME"));
-	rc = fetch(url, fname);
+	for (i = 0; i < tab->count; i++) {
+		if (!kept[i]) {
+			free_movie(old[i]);
+			changes++;
+		}
+	}
 
-	if (rc != 0) {
-		provider->error_number = 1;
-		return;
+	if (tab->sel >= n)
+		tab->sel = (n > 0) ? n - 1 : 0;
+	for (i = 0; i < n; i++) {
+		if (fresh->items[i]->id == sel_id) {
+			tab->sel = i;
+			break;
+		}
 	}
 
-	init();
+	free(tab->items);
+	tab->items = fresh->items;
+	tab->count = n;
+
+	free(old);
+	free(slots);
+	free(kept);
+	free(again);
+
+	return changes;
 }
 
-static json_object *
-get_cached(const char *url, const char *name)
+/* entries of the folder pages into the tab, unchanged pages keep theirs */
+static int
+sync_tab(struct movie_list *tab, struct paged *l, struct movie_list *parsed, const bool *changed_pages)
 {
-	char fname[PATH_MAX];
-	char full_url[500];
-	int rc = 0;
-	const char *error;
-	json_object *root;
-
-	snprintf(fname, PATH_MAX-1, "%s%s.json", cache_path, name);
+	struct movie_list fresh = { 0 };
+	int p, i, offset = 0, next = 0, changes;
+	bool changed = (l->count != l->prev_count);
+	int *pages;
+
+	for (p = 0; p < l->count; p++)
+		changed |= changed_pages[p];
+
+	if (!changed)
+		return 0;
+
+	pages = malloc(sizeof(int) * (tab->count + parsed->count + 1));
+
+	for (p = 0; p < l->count; p++) {
+		if (!changed_pages[p]) {
+			/* same page as before, at the same place in the tab */
+			for (i = 0; i < l->prev_kept[p] && offset + i < tab->count; i++) {
+				pages[fresh.count] = p;
+				append_movie(&fresh, tab->items[offset + i]);
+			}
+		} else {
+			for (i = 0; i < l->kept[p] && next < parsed->count; i++) {
+				pages[fresh.count] = p;
+				append_movie(&fresh, parsed->items[next++]);
+			}
+		}
 
-	if (expired(fname, 3600*24)) {
-		get_full_url(url, full_url);
-		rc = fetch(full_url, fname);
+		if (p < l->prev_count)
+			offset += l->prev_kept[p];
 	}
 
-	if (rc != 0) {
-		provider->error_number = 1;
-		return NULL;
-	}
+	/* the entries moved to fresh */
+	free(parsed->items);
+	parsed->items = NULL;
+	parsed->count = 0;
 
-	root = json_object_from_file(fname);
-	error = get_str(root, "error");
+	changes = merge_entries(tab, &fresh, pages);
 
-	if (rc == 0 && root != NULL && error == NULL)
-		return root;
+	memset(l->kept, 0, sizeof(l->kept));
+	for (i = 0; i < tab->count; i++)
+		l->kept[pages[i]]++;
+	free(pages);
 
-	sleep(2);
-	authorize(NULL);
-	get_full_url(url, full_url);
-	rc = fetch(url, fname);
+	return changes;
+}
 
-	root = json_object_from_file(fname);
-	error = get_str(root, "error");
+static void
+free_tab(struct movie_list *tab)
+{
+	int i;
 
-	if (rc != 0 || root == NULL) {
-		sprintf(last_error, "cannot load %s. rc: %d", fname, rc);
-		provider->error_number = 1;
-		return NULL;
-	}
+	for (i = 0; i < tab->count; i++)
+		free_movie(tab->items[i]);
+	free(tab->items);
+	free(tab->title);
+	free(tab);
+}
 
-	if (error != NULL) {
-		remove(fname);
-		sprintf(last_error, "api error: %s", error);
-		provider->error_number = 1;
-		return NULL;
-	}
+static void
+free_changes(struct list_changes *c)
+{
+	int i, j;
 
-	return root;
+	for (i = 0; i < MAX_FOLDERS; i++) {
+		free(c->titles[i]);
+		for (j = 0; j < c->fresh[i].count; j++)
+			free_movie(c->fresh[i].items[j]);
+		free(c->fresh[i].items);
+	}
+	free(c->pages);
+	free(c);
 }
 
-static json_object *
-fetch_favorite(int folder_id)
+/*
+ * Ids and titles of the fetched folders into c, with the pages of the
+ * folders that stay and new pages for the rest. Returns the folders count.
+ */
+static int
+parse_folders(struct list_changes *c)
 {
-	char url[500];
-	char name[100];
-
-	snprintf(url, 499, "%s/video/bookmarks/folders/%d/items.json?per_page=20", api_root, folder_id);
-	snprintf(name, 99, "fav-%d", folder_id);
-	json_object *root = get_cached(url, name);
+	json_object *entries, *folder;
+	const char *title;
+	int i, j, k, id, count = 0;
+
+	for (i = 0; i < folders_list->count; i++) {
+		entries = page_entries(folders_list->roots[i], "folders");
+
+		for (j = 0; j < (int)json_object_array_length(entries) && count < MAX_FOLDERS; j++) {
+			folder = json_object_array_get_idx(entries, j);
+			id = get_int(folder, "id");
+			title = get_str(folder, "title");
+			if (id <= 0 || title == NULL)
+				continue;
+
+			c->folder_ids[count] = id;
+			c->titles[count] = strdup(title);
+
+			for (k = 0; k < folders_count; k++) {
+				if (folder_ids[k] == id)
+					break;
+			}
+
+			if (k < folders_count) {
+				c->pages[count] = folder_pages[k];
+			} else {
+				struct paged *l = &c->pages[count];
+				memset(l, 0, sizeof(struct paged));
+				snprintf(l->url, sizeof(l->url), "%s/video/bookmarks/folders/%d/items.json?per_page=%d",
+					 api_root, id, PER_PAGE);
+				snprintf(l->name, sizeof(l->name), "fav-%d", id);
+				l->r = R_BOOKMARKS;
+				l->array = "bookmarks";
+			}
+			count++;
+		}
+	}
 
-	return root;
+	c->folders_count = count;
+	return count;
 }
 
+/* entries of the changed pages, a page with an error fails the folder */
 static void
-append_movie(struct movie_list *list, struct movie_entry *e)
+parse_pages(struct paged *l, struct movie_list *fresh, bool *parsed, char *error, size_t error_size)
 {
-	list->items = realloc(list->items, sizeof (struct movie_entry) * (list->count + 1));
-	list->items[list->count] = e;
-	list->count++;
+	int p, i, n;
+
+	for (p = 0; p < l->count && !l->failed; p++) {
+		if (l->roots[p] == NULL)
+			continue;
+
+		n = fresh->count;
+		if (append_favorites(fresh, l->roots[p], error, error_size) != 0) {
+			for (i = 0; i < fresh->count; i++)
+				free_movie(fresh->items[i]);
+			fresh->count = 0;
+			l->failed = true;
+			break;
+		}
+		l->kept[p] = fresh->count - n;
+		parsed[p] = true;
+	}
+
+	paged_release(l);
 }
 
+/*
+ * Fetches the folders and their pages, on any thread and without the tabs.
+ * Pages fetched before are fingerprinted, unchanged ones are not parsed.
+ */
 static void
-set_lowest_bitrate(json_object *files, struct movie_entry *e)
+fetch_favorites(struct list_changes *c)
 {
-	json_object *file;
-	int i, files_count = json_object_array_length(files);
-	bool has_mp4 = false;
-	bool has_wmv = false;
+	int i, n;
+	bool changed;
 
-	for (i = 0; i < files_count; i++) {
-		file = json_object_array_get_idx(files, i);
-		int bitrate = get_int(file, "bitrate");
-		const char *format = get_str(file, "format");
+	/* applied entries queue their series, the indexer waits for us */
+	user_request();
 
-		if (strcmp(format, "mp4") == 0 && bitrate == 400) {
-			has_mp4 = true;
-			break;
+	c->folders_count = -1;
+	paged_reset(folders_list);
+	if (fetch_paged(folders_list, 1, c->error, sizeof(c->error)) != 0)
+		return;
+
+	changed = (folders_list->count != folders_list->prev_count);
+	for (i = 0; i < folders_list->count; i++)
+		changed |= (folders_list->roots[i] != NULL);
+
+	c->pages = calloc(MAX_FOLDERS, sizeof(struct paged));
+	n = folders_count;
+	if (n > 0)
+		memcpy(c->pages, folder_pages, sizeof(struct paged) * n);
+
+	if (changed) {
+		/* all pages of a changed folder list are parsed, they are few */
+		memset(folders_list->fingerprints, 0, sizeof(folders_list->fingerprints));
+		paged_reset(folders_list);
+		n = 0;
+		if (fetch_paged(folders_list, 1, c->error, sizeof(c->error)) == 0) {
+			n = parse_folders(c);
+			if (n == 0)
+				snprintf(c->error, sizeof(c->error), "no favorite folders");
 		}
-		else if (strcmp(format, "wmv") == 0 && bitrate == 600) {
-			has_wmv = true;
+		paged_release(folders_list);
+
+		if (n == 0) {
+			free(c->pages);
+			c->pages = NULL;
+			return;
 		}
 	}
+	paged_release(folders_list);
 
-	if (has_mp4) {
-		e->format = SF_MP4;
-		e->bitrate = 400;
-	} else if (has_wmv) {
-		e->format = SF_WMV;
-		e->bitrate = 600;
-	}
+	for (i = 0; i < n; i++)
+		paged_reset(&c->pages[i]);
+
+	/* a failed folder keeps its entries until the next refresh */
+	fetch_paged(c->pages, n, c->error, sizeof(c->error));
+
+	for (i = 0; i < n; i++)
+		parse_pages(&c->pages[i], &c->fresh[i], c->parsed[i], c->error, sizeof(c->error));
 }
 
-static struct movie_entry *
-create_movie(json_object *obj)
+/*
+ * Tabs follow the fetched folders, tabs of folders that stay are kept.
+ * Returns the number of changes.
+ */
+static int
+sync_folders(struct movie_list *list, struct list_changes *c)
 {
-	json_object *files;
-	json_bool jres;
+	struct movie_list *shown = (list->tabs_count > 0) ? list->tabs[list->tab] : NULL;
+	struct movie_list **tabs = calloc(MAX_FOLDERS, sizeof(struct movie_list *));
+	int i, k, count = c->folders_count, changes = 0;
+
+	for (i = 0; i < count; i++) {
+		for (k = 0; k < list->tabs_count; k++) {
+			if (folder_ids[k] == c->folder_ids[i] && list->tabs[k] != NULL)
+				break;
+		}
 
-	struct movie_entry *e = malloc(sizeof(struct movie_entry));
+		if (k < list->tabs_count) {
+			tabs[i] = list->tabs[k];
+			list->tabs[k] = NULL;
+			if (!same_str(tabs[i]->title, c->titles[i])) {
+				free(tabs[i]->title);
+				tabs[i]->title = strdup(c->titles[i]);
+			}
+		} else {
+			tabs[i] = calloc(1, sizeof(struct movie_list));
+			tabs[i]->title = strdup(c->titles[i]);
+			changes++;
+		}
+	}
 
-	e->sel = 0;
-	e->id = get_int(obj, "id");
-	e->children_count = get_int(obj, "children_count");
-	e->name = strdup(get_str(obj, "name"));
-	e->description = strdup(get_str(obj, "description"));
-	e->on_air = strdup(get_str(obj, "on_air"));
+	/* removed folders */
+	for (k = 0; k < list->tabs_count; k++) {
+		if (list->tabs[k] != NULL) {
+			free_tab(list->tabs[k]);
+			changes++;
+		}
+	}
 
-	jres = json_object_object_get_ex(obj, "files", &files);
-	if (jres)
-		set_lowest_bitrate(files, e);
+	free(list->tabs);
+	list->tabs = tabs;
+	list->tabs_count = count;
+	memcpy(folder_ids, c->folder_ids, sizeof(int) * count);
+	folders_count = count;
 
-	logi("id: %d, name: %s, format: %d, bitrate: %d", e->id, e->name, e->format, e->bitrate);
+	list->tab = 0;
+	for (i = 0; i < count; i++) {
+		if (tabs[i] == shown)
+			list->tab = i;
+	}
 
-	return e;
+	return changes;
 }
 
-static json_object *
-get_data(json_object *root, const char *name)
+/* changes of the favorites, on any thread, the list is only compared */
+static struct list_changes *
+fetch_changes(struct movie_list *list)
 {
-	json_object *data, *obj;
-	json_bool jres;
-
-	jres = json_object_object_get_ex(root, "data", &data);
-	if (jres == FALSE) {
-		sprintf(last_error, "Cannot get data for %s", name);
-		provider->error_number = 1;
-		return  NULL;
-	}
+	struct list_changes *c = calloc(1, sizeof(struct list_changes));
 
-	jres = json_object_object_get_ex(data, name, &obj);
-	if (jres == FALSE) {
-		sprintf(last_error, "Cannot get data/%s", name);
-		provider->error_number = 1;
-		return NULL;
+	if (list == NULL || list != favorites) {
+		c->folders_count = -1;
+		snprintf(c->error, sizeof(c->error), "not a loaded list");
+		return c;
 	}
 
-	return obj;
+	fetch_favorites(c);
+	return c;
 }
 
-static struct movie_list *
-parse_favorites(json_object *root)
+/*
+ * Brings the tabs up to the fetched folders and pages and frees the
+ * changes. Returns the number of changes, -1 with the tabs untouched if
+ * the folders could not be fetched.
+ */
+static int
+apply_changes(struct movie_list *list, struct list_changes *c)
 {
-	int i;
-
-	json_object *bookmarks, *bookmark;
-	int bookmarks_count;
+	int i, changes = 0;
 
-	int status = get_int(root, "status_code");
-	if (status != 200) {
-		sprintf(last_error, "invalid status %d", status);
+	provider->error_number = 0;
+	if (c->error[0] != 0) {
+		snprintf(last_error, sizeof(last_error), "%s", c->error);
 		provider->error_number = 1;
-		return NULL;
 	}
 
-	struct movie_list *list = calloc(1, sizeof(struct movie_list));
-	bookmarks = get_data(root, "bookmarks");
-	bookmarks_count = json_object_array_length(bookmarks);
+	if (list == NULL || list != favorites || c->pages == NULL) {
+		free_changes(c);
+		return -1;
+	}
 
-	for (i = 0; i < bookmarks_count; i++) {
-		bookmark = json_object_array_get_idx(bookmarks, i);
-		if (bookmark == NULL) {
-			sprintf(last_error, "Cannot get bookmark[%d]", i);
-			provider->error_number = 1;
-			return NULL;
-		}
+	if (c->folders_count >= 0)
+		changes += sync_folders(list, c);
 
-		struct movie_entry *e = create_movie(bookmark);
-		append_movie(list, e);
+	free(folder_pages);
+	folder_pages = c->pages;
+	c->pages = NULL;
+
+	for (i = 0; i < list->tabs_count; i++) {
+		if (!folder_pages[i].failed)
+			changes += sync_tab(list->tabs[i], &folder_pages[i], &c->fresh[i], c->parsed[i]);
 	}
 
-	return list;
+	free_changes(c);
+	return changes;
 }
 
+/* every bookmark folder is a tab, all pages of them are loaded in parallel */
 static struct movie_list *
 load()
 {
-	char url[500];
-	json_object *root, *folders, *folder;
+	struct movie_list *list = calloc(1, sizeof(struct movie_list));
 	int i;
 
-	provider->error_number = 0;
-	snprintf(url, 499, "%s/video/bookmarks/folders.json?per_page=20", api_root);
-
-	root = get_cached(url, "favorites");
-	if (provider->error_number != 0)
+	/* a new list, the old one belongs to the caller */
+	free(folders_list);
+	free(folder_pages);
+	folders_list = calloc(1, sizeof(struct paged));
+	folder_pages = NULL;
+	folders_count = 0;
+	favorites = list;
+
+	snprintf(folders_list->url, sizeof(folders_list->url),
+		 "%s/video/bookmarks/folders.json?per_page=%d", api_root, PER_PAGE);
+	snprintf(folders_list->name, sizeof(folders_list->name), "favorites");
+	folders_list->r = R_FOLDERS;
+	folders_list->array = "folders";
+
+	if (apply_changes(list, fetch_changes(list)) < 0) {
+		favorites = NULL;
+		free(list);
 		return NULL;
-
-	folders = get_data(root, "folders");
-	int folders_count = json_object_array_length(folders);
-	int folder_id = 0;
-
-	for (i = 0; i < folders_count; i++) {
-		folder = json_object_array_get_idx(folders, i);
-		if (folder == NULL) {
-			sprintf(last_error, "Cannot get folder[%d]", i);
-			provider->error_number = 1;
-			return  NULL;
-		}
-
-		const char *title = get_str(folder, "title");
-		if (strcmp(title, "serge") == 0) {
-			folder_id = get_int(folder, "id");
-			break;
-		}
 	}
 
-	if (folder_id == 0) {
-		sprintf(last_error, "cannot get my favorite folder");
-		provider->error_number = 1;
-		return NULL;
+	/* the folder the single list used to show */
+	for (i = 0; i < list->tabs_count; i++) {
+		if (strcmp(list->tabs[i]->title, "serge") == 0)
+			list->tab = i;
 	}
 
-	root = fetch_favorite(folder_id);
-	if (provider->error_number != 0)
-		return NULL;
-
-	struct movie_list *list = parse_favorites(root);
+	/* the shown tab first */
+	user_request();
+	queue_series(list->tabs[list->tab]);
+	for (i = 0; i < list->tabs_count; i++) {
+		if (i != list->tab)
+			queue_series(list->tabs[i]);
+	}
 
 	return list;
 }
@@ -381,53 +1929,16 @@ static void
 init()
 {
 	char fname[PATH_MAX];
-	const char *v;
 
-	asprintf(&cache_path, "%s/.cache/etvcc/", getenv("HOME"));
 	snprintf(fname, PATH_MAX-1, "%s/.local/etvcc/token.json", getenv("HOME"));
 
-	if (!exists(fname)) {
-		sprintf(last_error, "no token file");
-		goto not_activated;
-	}
-
-	json_object *root = json_object_from_file(fname);
-	if (root == NULL) {
-		sprintf(last_error, "bad token json");
-		goto not_activated;
-	}
-
-
-	v = get_str(root, "error");
-	if (v != NULL) {
-		sprintf(last_error, "token error: %s", v);
-		goto not_activated;
-	}
-
-	v = get_str(root, "access_token");
-	if (v == NULL) {
-		sprintf(last_error, "bad access token");
-		goto not_activated;
-
-	}
-
-	access_token = strdup(v);
-
-	v = get_str(root, "refresh_token");
-	if (v == NULL) {
-		sprintf(last_error, "bad refresh token");
-		goto not_activated;
-
+	if (read_token(fname, last_error, sizeof(last_error)) != 0) {
+		provider->error_number = 1;
+		return;
 	}
 
-	refresh_token = strdup(v);
-
 	last_error[0] = 0;
 	provider->error_number = 0;
-	return;
-
-not_activated:
-	provider->error_number = 1;
 }
 
 static char *
@@ -451,9 +1962,9 @@ get_stream_url(struct movie_entry *e)
 	}
 
 	snprintf(name, 99, "stream-%d", e->id);
-	logi("fetch %s to %s", url, name);
+	rlogi("fetch %s to %s", url, name);
 
-	root = get_cached(url, name);
+	root = get_cached(url, name, R_STREAM);
 	if (provider->error_number != 0)
 		return NULL;
 
@@ -484,6 +1995,29 @@ get_movie(int parent_id, int idx)
 	json_object *root, *children, *child;
 
 	provider->error_number = 0;
+
+	struct movie_entry *e = find_movie(parent_id, idx);
+	if (e != NULL)
+		return e;
+
+	/* saved index not picked up by the indexer yet */
+	struct parts_index *ix = parts_load(parent_id);
+	if (ix != NULL) {
+		pthread_mutex_lock(&parts_lock);
+		if (parts_find(parent_id) == NULL)
+			parts_publish(ix);
+		else
+			parts_free(ix);
+		pthread_mutex_unlock(&parts_lock);
+
+		e = find_movie(parent_id, idx);
+		if (e != NULL)
+			return e;
+	}
+
+	user_request();
+	queue_parts(parent_id, idx + 1, true);
+
 	int page = (idx / 20) + 1;
 	int pos_on_page = idx - (page - 1) * 20;
 
@@ -491,9 +2025,9 @@ get_movie(int parent_id, int idx)
 		 api_root, parent_id, page);
 
 	snprintf(name, 99, "child-%d-%d", parent_id, idx);
-	logi("fetch %s to %s", url, name);
+	rlogi("fetch %s to %s", url, name);
 
-	root = get_cached(url, name);
+	root = get_cached(url, name, R_CHILDREN);
 	if (provider->error_number != 0) {
 		return NULL;
 	}
@@ -508,7 +2042,7 @@ get_movie(int parent_id, int idx)
 	}
 
 	child = json_object_array_get_idx(children, pos_on_page);
-	struct movie_entry *e = create_movie(child);
+	e = etvnet_create_movie(child);
 
 	return e;
 }
@@ -583,11 +2117,29 @@ get_activation_code(char **user_code, char **device_code)
 	*user_code = strdup(v);
 }
 
-struct provider *
-etvnet_get_provider() {
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+
+static void
+start_threads()
+{
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, refresher, NULL);
+	pthread_detach(tid);
+	pthread_create(&tid, NULL, indexer, NULL);
+	pthread_detach(tid);
+}
+
+static pthread_mutex_t provider_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static void
+create_provider()
+{
 	provider = calloc(1, sizeof(struct provider));
 
+	if (getenv("CTV_ETVNET_API") != NULL)
+		api_root = getenv("CTV_ETVNET_API");
+
 	init();
 
 	provider->name = strdup("etvnet");
@@ -596,7 +2148,22 @@ etvnet_get_provider() {
 	provider->get_activation_code = get_activation_code;
 	provider->authorize = authorize;
 	provider->get_movie = get_movie;
+	provider->find_movie = find_movie;
+	provider->fetch_changes = fetch_changes;
+	provider->apply_changes = apply_changes;
 	provider->get_stream_url = get_stream_url;
 
+	/* every menu visit gets the provider, the threads must not pile up */
+	pthread_once(&threads_once, start_threads);
+}
+
+struct provider *
+etvnet_get_provider() {
+	/* one instance per process, loader() and activate_tv_box() may ask at once */
+	pthread_mutex_lock(&provider_lock);
+	if (provider == NULL)
+		create_provider();
+	pthread_mutex_unlock(&provider_lock);
+
 	return provider;
 }
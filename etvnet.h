@@ -1 +1,8 @@
 struct provider *etvnet_get_provider();
+
+/* parsing of api responses, exposed for the benchmarks */
+struct json_object;
+struct movie_entry;
+
+void etvnet_set_lowest_bitrate(struct json_object *files, struct movie_entry *e);
+struct movie_entry *etvnet_create_movie(struct json_object *obj);
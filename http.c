@@ -0,0 +1,534 @@
+/* strcasestr */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include "rlog.h"
+#include "metrics.h"
+#include "trace.h"
+#include "http.h"
+
+#define CONNECT_TIMEOUT_MS 10000
+#define STALL_SEC 30            /* abort transfers receiving nothing this long */
+#define BACKOFF_MS 250          /* before the first retry, doubled for the next */
+#define MAX_HOSTS 16
+#define HOST_SAMPLES 32         /* recent round trips kept for p95 */
+#define HEDGE_MIN_SAMPLES 8
+#define HOST_BURST 32           /* a cold list load fits in it */
+#define HOST_RATE 10            /* requests per second once the burst is used */
+
+struct transfer {
+	CURL *curl;
+	FILE *f;
+	struct http_buf buf;
+	struct http_opts *opts;
+	off_t resume_from;
+	char errbuf[CURL_ERROR_SIZE];
+	CURLcode rc;
+	long status;
+	long max_age;
+	size_t delivered;       /* to the file or on_body, cannot be taken back */
+	bool done;
+	bool checked;
+	bool discard;
+	bool stopped;           /* by on_body, not an error */
+};
+
+struct host {
+	char name[128];
+	uint32_t samples[HOST_SAMPLES];
+	int nsamples;
+	int next;
+	double tokens;
+	uint64_t refilled;
+};
+
+static pthread_mutex_t hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host hosts[MAX_HOSTS];
+static int nhosts;
+
+void
+http_buf_clean(struct http_buf *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->len = 0;
+}
+
+static struct host *
+get_host(const char *url)
+{
+	char name[128];
+	const char *p = strstr(url, "://");
+	struct host *h;
+	size_t n;
+	int i;
+
+	p = (p != NULL) ? p + 3 : url;
+	n = strcspn(p, "/?#");
+	if (n >= sizeof(name))
+		n = sizeof(name) - 1;
+	memcpy(name, p, n);
+	name[n] = 0;
+
+	pthread_mutex_lock(&hosts_lock);
+
+	for (i = 0; i < nhosts; i++) {
+		if (strcmp(hosts[i].name, name) == 0) {
+			pthread_mutex_unlock(&hosts_lock);
+			return &hosts[i];
+		}
+	}
+
+	/* table is small, the oldest host is forgotten */
+	h = &hosts[nhosts % MAX_HOSTS];
+	if (nhosts < MAX_HOSTS)
+		nhosts++;
+	memset(h, 0, sizeof(struct host));
+	strcpy(h->name, name);
+	h->tokens = HOST_BURST;
+	h->refilled = metrics_now();
+
+	pthread_mutex_unlock(&hosts_lock);
+	return h;
+}
+
+/* callers hold hosts_lock */
+static void
+refill(struct host *h)
+{
+	uint64_t now = metrics_now();
+
+	h->tokens += (now - h->refilled) * HOST_RATE / 1e6;
+	if (h->tokens > HOST_BURST)
+		h->tokens = HOST_BURST;
+	h->refilled = now;
+}
+
+/* token bucket, waits for the slot reserved for this request */
+static void
+rate_wait(struct host *h)
+{
+	uint64_t wait = 0;
+
+	pthread_mutex_lock(&hosts_lock);
+
+	refill(h);
+	if (h->tokens < 1)
+		wait = (1 - h->tokens) * 1e6 / HOST_RATE;
+	h->tokens -= 1;
+
+	pthread_mutex_unlock(&hosts_lock);
+
+	if (wait > 0)
+		usleep(wait);
+}
+
+/* takes a token if one is there now, a hedge is not worth waiting for */
+static bool
+rate_try(struct host *h)
+{
+	bool taken;
+
+	pthread_mutex_lock(&hosts_lock);
+
+	refill(h);
+	taken = (h->tokens >= 1);
+	if (taken)
+		h->tokens -= 1;
+
+	pthread_mutex_unlock(&hosts_lock);
+
+	return taken;
+}
+
+static void
+host_sample(struct host *h, uint64_t usec)
+{
+	pthread_mutex_lock(&hosts_lock);
+	h->samples[h->next] = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+	h->next = (h->next + 1) % HOST_SAMPLES;
+	if (h->nsamples < HOST_SAMPLES)
+		h->nsamples++;
+	pthread_mutex_unlock(&hosts_lock);
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* p95 of recent round trips to the host, 0 until there are enough */
+static uint64_t
+host_p95(struct host *h)
+{
+	uint32_t s[HOST_SAMPLES];
+	int n;
+
+	pthread_mutex_lock(&hosts_lock);
+	n = h->nsamples;
+	memcpy(s, h->samples, sizeof(s));
+	pthread_mutex_unlock(&hosts_lock);
+
+	if (n < HEDGE_MIN_SAMPLES)
+		return 0;
+
+	qsort(s, n, sizeof(uint32_t), cmp_u32);
+	return s[n * 95 / 100];
+}
+
+static size_t
+on_data(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct transfer *t = userdata;
+	size_t n = size * nmemb;
+
+	if (!t->checked) {
+		long status = 0;
+
+		/* server ignored the range and sends the whole body */
+		curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &status);
+		if (t->f != NULL && t->resume_from > 0 && status == 200) {
+			rlogi("range ignored, restart from 0");
+			fflush(t->f);
+			ftruncate(fileno(t->f), 0);
+			rewind(t->f);
+		}
+		t->discard = (status >= 400);
+		t->checked = true;
+	}
+
+	/* keep error pages out of the partial downloads */
+	if (t->discard)
+		return n;
+
+	if (t->f != NULL) {
+		t->delivered += n;
+		return fwrite(ptr, 1, n, t->f);
+	}
+
+	if (t->opts->on_body != NULL) {
+		t->delivered += n;
+		if (t->opts->on_body(ptr, n, t->opts->arg))
+			return n;
+		t->stopped = true;
+		return 0;
+	}
+
+	char *p = realloc(t->buf.data, t->buf.len + n + 1);
+	if (p == NULL)
+		return 0;
+
+	memcpy(p + t->buf.len, ptr, n);
+	t->buf.data = p;
+	t->buf.len += n;
+	p[t->buf.len] = 0;
+
+	return n;
+}
+
+/* freshness of the response, no-store and no-cache count as 0 */
+static size_t
+on_header(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct transfer *t = userdata;
+	size_t n = size * nmemb;
+	char line[256], *p;
+
+	if (n >= sizeof(line))
+		return n;
+	memcpy(line, ptr, n);
+	line[n] = 0;
+
+	/* headers of a redirect do not count */
+	if (strncmp(line, "HTTP/", 5) == 0) {
+		t->max_age = -1;
+		return n;
+	}
+
+	if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+		if (strcasestr(line, "no-store") != NULL || strcasestr(line, "no-cache") != NULL)
+			t->max_age = 0;
+		else if ((p = strcasestr(line, "max-age=")) != NULL)
+			t->max_age = atol(p + 8);
+
+	} else if (strncasecmp(line, "Expires:", 8) == 0 && t->max_age == -1) {
+		line[strcspn(line, "\r\n")] = 0;
+		time_t expires = curl_getdate(line + 8, NULL);
+		if (expires != -1)
+			t->max_age = (expires > time(NULL)) ? expires - time(NULL) : 0;
+	}
+
+	return n;
+}
+
+static int
+transfer_start(struct transfer *t, const char *url, struct http_opts *opts, long timeout_ms)
+{
+	memset(t, 0, sizeof(struct transfer));
+	t->opts = opts;
+	t->resume_from = opts->resume_from;
+	t->max_age = -1;
+
+	if (opts->fname != NULL) {
+		t->f = fopen(opts->fname, (opts->resume_from > 0) ? "ab" : "wb");
+		if (t->f == NULL)
+			return -1;
+	}
+
+	t->curl = curl_easy_init();
+	curl_easy_setopt(t->curl, CURLOPT_URL, url);
+	curl_easy_setopt(t->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(t->curl, CURLOPT_ERRORBUFFER, t->errbuf);
+	curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, on_data);
+	curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, on_header);
+	curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t);
+	curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT_MS, (long)CONNECT_TIMEOUT_MS);
+
+	/* hung connections, whatever the deadline */
+	curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_TIME, (long)STALL_SEC);
+
+	if (timeout_ms > 0)
+		curl_easy_setopt(t->curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+
+	/* plain range instead of RESUME_FROM, servers without ranges restart */
+	if (opts->resume_from > 0) {
+		char range[32];
+		snprintf(range, sizeof(range), "%jd-", (intmax_t)opts->resume_from);
+		curl_easy_setopt(t->curl, CURLOPT_RANGE, range);
+	}
+
+	if (opts->max_rate > 0)
+		curl_easy_setopt(t->curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)opts->max_rate);
+
+	return 0;
+}
+
+/* returns downloaded bytes */
+static curl_off_t
+transfer_finish(struct transfer *t)
+{
+	curl_off_t bytes = 0;
+
+	if (t->curl == NULL)
+		return 0;
+
+	curl_easy_getinfo(t->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	curl_easy_cleanup(t->curl);
+	t->curl = NULL;
+
+	if (t->f != NULL)
+		fclose(t->f);
+	http_buf_clean(&t->buf);
+
+	return bytes;
+}
+
+static bool
+succeeded(const struct transfer *t)
+{
+	if (t->rc != CURLE_OK)
+		return false;
+
+	/* range starts at the end of the complete file */
+	return t->status < 400 || (t->status == 416 && t->resume_from > 0);
+}
+
+static bool
+transient(const struct transfer *t)
+{
+	switch (t->rc) {
+		case CURLE_OK:
+			return t->status == 429 || t->status >= 500;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_SSL_CONNECT_ERROR:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Run the transfer. Once it is slower than hedge_us a second identical
+ * one is started if the host has a token to spare, the first good
+ * response wins.
+ */
+static struct transfer *
+perform(const char *url, struct http_opts *opts, struct host *host, struct transfer *t,
+	uint64_t hedge_us, long timeout_ms)
+{
+	CURLM *multi = curl_multi_init();
+	struct transfer *winner = NULL;
+	uint64_t start = metrics_now();
+	int n = 1, running, left, i, done;
+	CURLMsg *msg;
+
+	curl_multi_add_handle(multi, t[0].curl);
+
+	for (;;) {
+		curl_multi_perform(multi, &running);
+
+		while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			for (i = 0; i < n; i++) {
+				if (t[i].curl != msg->easy_handle)
+					continue;
+				t[i].rc = msg->data.result;
+				t[i].done = true;
+				curl_easy_getinfo(t[i].curl, CURLINFO_RESPONSE_CODE, &t[i].status);
+				if (t[i].rc == CURLE_WRITE_ERROR && t[i].stopped)
+					t[i].rc = CURLE_OK;
+			}
+		}
+
+		for (i = 0, done = 0; i < n; i++) {
+			if (t[i].done && succeeded(&t[i]) && winner == NULL)
+				winner = &t[i];
+			done += t[i].done;
+		}
+
+		if (winner == NULL && done == n)
+			winner = &t[0];
+		if (winner != NULL)
+			break;
+
+		uint64_t elapsed = metrics_now() - start;
+		if (n == 1 && hedge_us > 0 && elapsed > hedge_us) {
+			long left_ms = (timeout_ms > 0) ? timeout_ms - (long)(elapsed / 1000) : 0;
+			if (left_ms >= 0 && rate_try(host) && transfer_start(&t[1], url, opts, left_ms) == 0) {
+				curl_multi_add_handle(multi, t[1].curl);
+				metrics_count(C_FETCH_HEDGES, 1);
+				n = 2;
+			}
+			/* one try, without a token the host is busy enough */
+			hedge_us = 0;
+		}
+
+		curl_multi_wait(multi, NULL, 0, 20, NULL);
+	}
+
+	for (i = 0; i < n; i++)
+		curl_multi_remove_handle(multi, t[i].curl);
+	curl_multi_cleanup(multi);
+
+	return winner;
+}
+
+int
+http_get(const char *url, struct http_opts *opts)
+{
+	struct transfer t[2];
+	struct transfer *w;
+	struct host *host = get_host(url);
+	uint64_t start = metrics_now(), attempt_start, hedge_us;
+	uint64_t deadline = (opts->deadline_ms > 0) ? start + opts->deadline_ms * 1000ULL : 0;
+	curl_off_t bytes = 0;
+	long timeout_ms = 0;
+	int rc, tries;
+
+	/* a second request cannot share the file or the body callback */
+	bool hedge = opts->hedge && opts->fname == NULL && opts->on_body == NULL;
+
+	opts->max_age = -1;
+	trace_begin("fetch");
+
+	for (tries = 0; ; tries++) {
+		rate_wait(host);
+
+		if (deadline != 0) {
+			timeout_ms = ((int64_t)deadline - (int64_t)metrics_now()) / 1000;
+			if (timeout_ms <= 0) {
+				snprintf(opts->error, opts->error_size, "%s: deadline exceeded", url);
+				metrics_count(C_FETCH_TIMEOUTS, 1);
+				rc = CURLE_OPERATION_TIMEDOUT;
+				break;
+			}
+		}
+
+		memset(t, 0, sizeof(t));
+		if (transfer_start(&t[0], url, opts, timeout_ms) != 0) {
+			snprintf(opts->error, opts->error_size, "cannot open %s", opts->fname);
+			rc = -1;
+			break;
+		}
+
+		hedge_us = hedge ? host_p95(host) : 0;
+		attempt_start = metrics_now();
+		w = perform(url, opts, host, t, hedge_us, timeout_ms);
+
+		rc = (w->rc != CURLE_OK) ? (int)w->rc : (succeeded(w) ? 0 : (int)w->status);
+		if (rc == 0) {
+			host_sample(host, metrics_now() - attempt_start);
+			if (opts->error_size > 0)
+				opts->error[0] = 0;
+			opts->max_age = w->max_age;
+			if (opts->buf != NULL) {
+				http_buf_clean(opts->buf);
+				*opts->buf = w->buf;
+				memset(&w->buf, 0, sizeof(w->buf));
+			}
+		} else if (w->rc != CURLE_OK) {
+			snprintf(opts->error, opts->error_size, "%s: %s", url,
+				 w->errbuf[0] ? w->errbuf : curl_easy_strerror(w->rc));
+		} else {
+			snprintf(opts->error, opts->error_size, "%s: http status %ld", url, w->status);
+		}
+
+		if (w->rc == CURLE_OPERATION_TIMEDOUT)
+			metrics_count(C_FETCH_TIMEOUTS, 1);
+
+		bool retry = rc != 0 && transient(w) && tries < opts->retries &&
+			t[0].delivered == 0 && t[1].delivered == 0;
+
+		bytes += transfer_finish(&t[0]) + transfer_finish(&t[1]);
+
+		if (!retry)
+			break;
+
+		/* jittered exponential backoff, not past the deadline */
+		uint64_t backoff = (BACKOFF_MS * 1000ULL << tries) * (75 + rand() % 50) / 100;
+		if (deadline != 0 && metrics_now() + backoff >= deadline)
+			break;
+
+		rlogi("retry %s in %llu ms: %s", url, (unsigned long long)backoff / 1000, opts->error);
+		metrics_count(C_FETCH_RETRIES, 1);
+		usleep(backoff);
+	}
+
+	trace_end("fetch");
+
+	metrics_since(H_FETCH, start);
+	metrics_count(C_FETCH_BYTES, bytes);
+
+	if (rc != 0)
+		metrics_count(C_FETCH_ERRORS, 1);
+
+	return rc;
+}
+
+void
+http_init()
+{
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+}
@@ -0,0 +1,36 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* response body collected in memory, always null terminated */
+struct http_buf {
+	char *data;
+	size_t len;
+};
+
+struct http_opts {
+	const char *fname;      /* write response to the file */
+	struct http_buf *buf;   /* or collect it in the memory */
+	/* or pass it to on_body as it arrives, false stops the transfer early */
+	bool (*on_body)(const char *data, size_t len, void *arg);
+	void *arg;
+	off_t resume_from;      /* append to fname starting from this offset */
+	long max_rate;          /* bytes per second, 0 is unlimited */
+	int deadline_ms;        /* whole request with retries, 0 is none */
+	int retries;            /* extra attempts after transient errors */
+	bool hedge;             /* second request once slower than the host p95 */
+	long max_age;           /* set from Cache-Control or Expires, -1 if none */
+	char *error;
+	size_t error_size;
+};
+
+void http_buf_clean(struct http_buf *b);
+
+/*
+ * GET url. Returns 0 on success, curl error or http status otherwise.
+ * Requests to the same host are rate limited.
+ */
+int http_get(const char *url, struct http_opts *opts);
+
+/* global initialization, call before starting any threads */
+void http_init();
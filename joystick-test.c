@@ -3,6 +3,7 @@
 #include <ncursesw/ncurses.h>
 #include "joystick.h"
 #include "common/log.h"
+#include "rlog.h"
 
 static char *keystr[1024] = {
 	[13] = "CR",
@@ -25,6 +26,7 @@ int main()
 	int count = 0, rc;
 
 	log_set(stderr);
+	rlog_init(NULL, 0, RLOG_DEBUG);
 	joystick_init();
 
 	initscr();
@@ -11,6 +11,10 @@
 #include <ncursesw/ncurses.h>
 #include "common/fs.h"
 #include "common/log.h"
+#include "rlog.h"
+#include "joystick.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define SYSFS_GPIO_DIR "/sys/class/gpio"
 #define MAX_BUF 64
@@ -126,6 +130,9 @@ static int fds[FD_SIZE] =         { -1, -1, -1, -1, -1, 0 };  /* descriptors */
 static int keys[MAX_PINS] = { KEY_DOWN, KEY_LEFT, KEY_UP, KEY_RIGHT, KEY_HOME };
 static uint64_t last_press;
 static int last_pin = -1;
+static uint64_t key_time;    /* capture time of the last event, usec */
+static char text[65];        /* bytes of the last keyboard event */
+static int text_len;
 
 static struct pollfd fdset[FD_SIZE]; /* pool structs for 5 joystick buttons and stdin */
 
@@ -145,25 +152,25 @@ init_pins()
 	for (i = 0; i < MAX_PINS; i++) {
 		rc = gpio_export(pins[i]);
 		if (rc != 0) {
-			logwarn("cannot export pin %d", pins[i]);
+			rlogw("cannot export pin %d", pins[i]);
 			return false;
 		}
 
 		rc = gpio_set_dir(pins[i], 0);
 		if (rc != 0) {
-			logwarn("cannot set dir to in for pin %d", pins[i]);
+			rlogw("cannot set dir to in for pin %d", pins[i]);
 			return false;
 		}
 
 		rc = gpio_set_edge(pins[i], "falling");
 		if (rc != 0) {
-			logwarn("cannot set falling edge for pin %d", pins[i]);
+			rlogw("cannot set falling edge for pin %d", pins[i]);
 			return false;
 		}
 
 		rc = gpio_set_active_low(pins[i], 0);
 		if (rc != 0) {
-			logwarn("cannot set active low for pin %d", pins[i]);
+			rlogw("cannot set active low for pin %d", pins[i]);
 			return false;
 		}
 
@@ -171,13 +178,13 @@ init_pins()
 		snprintf(pullup_cmd, 99, "gpio mode %d up", gpio[i]);
 		rc = system(pullup_cmd);
 		if (rc != 0) {
-			logwarn("cannot exec %s. rc: %d", pullup_cmd, rc);
+			rlogw("cannot exec %s. rc: %d", pullup_cmd, rc);
 			return false;
 		}
 
 		fds[i] = gpio_fd_open(pins[i]);
 		if (fds[i] == -1) {
-			logwarn("cannot open pin %d", pins[i]);
+			rlogw("cannot open pin %d", pins[i]);
 			return false;
 		}
 
@@ -200,7 +207,7 @@ joystick_init()
 	last_press = get_ms();
 
 	if (!exists(SYSFS_GPIO_DIR)) {
-		logwarn("%s doesnt exist. Skip joystick initialization.", SYSFS_GPIO_DIR);
+		rlogw("%s doesnt exist. Skip joystick initialization.", SYSFS_GPIO_DIR);
 		return;
 	}
 
@@ -229,7 +236,7 @@ wait_event(int timeout, int *key)
 
 	rc = poll(fdset, FD_SIZE, timeout);
 	if (rc < 0) {
-		logwarn("poll() failed: %d, %s", rc, strerror(rc));
+		rlogw("poll() failed: %d, %s", rc, strerror(rc));
 		sleep(5);
 	}
 
@@ -237,12 +244,17 @@ wait_event(int timeout, int *key)
 		if (fdset[i].revents == 0)
 			continue;
 
+		key_time = metrics_now();
 		lseek(fdset[i].fd, 0, SEEK_SET);
 		ssize_t was_read = read(fdset[i].fd, buf, 64);
-		logi("i: %d, was_read: %d, b: %d,%d,%d\r", i, was_read, buf[0], buf[1], buf[1], buf[2]);
+		rlogd("i: %d, was_read: %zd, b: %d,%d,%d", i, was_read, buf[0], buf[1], buf[2]);
 		rc--;
 		ch = (i == MAX_PINS) ? buf[0] : keys[i];
 		pin = i;
+
+		text_len = (i == MAX_PINS && was_read > 0) ? was_read : 0;
+		memcpy(text, buf, text_len);
+		text[text_len] = 0;
 	}
 	
 	if (ch != -1) {
@@ -275,34 +287,71 @@ map_key(int key)
 	}
 }
 
+uint64_t
+joystick_key_time()
+{
+	return key_time;
+}
+
+const char *
+joystick_text()
+{
+	return text;
+}
+
 int
 joystick_getch()
 {
-	int pin1, key1 = -1;
+	return joystick_getch_timeout(-1);
+}
+
+int
+joystick_getch_timeout(int timeout)
+{
+	int pin, pin1 = -1, key1 = -1;
 
 	uint64_t now = get_ms();
+	uint64_t start = metrics_now();
 
 	if (last_pin != MAX_PINS && now - last_press < 2000) {
-		wait_event(10, &key1);
+		if ((pin = wait_event(10, &key1)) != -1)
+			pin1 = pin;
 		now = get_ms();
 		if (debug)
-			logi("now: %llu last: %llu\r", now, last_press);
+			rlogd("now: %llu last: %llu", (unsigned long long)now, (unsigned long long)last_press);
 
 		while (now - last_press < 300) {
-			wait_event(100, &key1);
+			if ((pin = wait_event(100, &key1)) != -1)
+				pin1 = pin;
 			now = get_ms();
 			if (debug)
-				logi("now: %llu last: %llu, diff: %llu\r", now, last_press, now - last_press);
+				rlogd("now: %llu last: %llu, diff: %llu", (unsigned long long)now,
+				      (unsigned long long)last_press, (unsigned long long)(now - last_press));
 		}
-		wait_event(1, &key1);
+		if ((pin = wait_event(1, &key1)) != -1)
+			pin1 = pin;
 		now = get_ms();
 		if (debug)
-			logi("now: %llu last: %llu\r", now, last_press);
+			rlogd("now: %llu last: %llu", (unsigned long long)now, (unsigned long long)last_press);
+
+		metrics_since(H_DEBOUNCE, start);
 	}
 
-	pin1 = wait_event(60000, &key1);
-	last_press = get_ms();
-	last_pin = pin1;
+	/* a key read during the debounce is not held back */
+	if (key1 == -1) {
+		trace_begin("joystick_wait");
+		pin1 = wait_event(timeout, &key1);
+		trace_end("joystick_wait");
+	}
+
+	/* a timeout is no press, the next key is not debounced for it */
+	if (pin1 != -1) {
+		last_press = get_ms();
+		last_pin = pin1;
+	}
+
+	if (key1 != -1)
+		metrics_count(C_KEYS, 1);
 
 	return map_key(key1);
 }
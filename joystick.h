@@ -35,4 +35,15 @@ RPI B pins (from "gpio readall"):
 #include <stdint.h>
 
 void joystick_init();
+
+/* wait for a key forever */
 int joystick_getch();
+
+/* wait for a key up to timeout ms, -1 waits forever. Returns -1 on timeout */
+int joystick_getch_timeout(int timeout);
+
+/* capture time of the last key, metrics_now() clock */
+uint64_t joystick_key_time();
+
+/* bytes read from the keyboard for the last key, e.g. a whole utf-8 character. Empty for buttons */
+const char *joystick_text();
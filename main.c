@@ -11,23 +11,38 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
 #include <locale.h>
+#include <pthread.h>
 #include <termios.h>
 #include "common/struct.h"
 #include "common/log.h"
+#include "rlog.h"
 #include "version.h"
 #include "provider.h"
 #include "etvnet.h"
 #include "smithsonian.h"
+#include "synthetic.h"
 #include "util.h"
 #include "joystick.h"
+#include "http.h"
+#include "download.h"
+#include "pack.h"
+#include "power.h"
+#include "metrics.h"
+#include "trace.h"
+#include "selections.h"
+#include "search.h"
 
 static void
 synopsis()
 {
-	printf("usage: ctv [-hdptvc] [name]\n");
+	printf("usage: ctv [-hdptvcD] [-T trace.json] [name]\n");
 }
 
+#define CACHE_SIZE_MB 64
+
 static void
 usage()
 {
@@ -36,8 +51,16 @@ usage()
 	synopsis();
 	printf("options:\n"
 	       "  -a    activate tv box on etvnet.com\n"
-	       "  -d    dump debug output to stderr\n"
+	       "  -d    write debug records to ctv.log\n"
+	       "  -D    download queued movies now and exit\n"
+	       "  -T file  record spans to file for chrome://tracing\n"
 	       "  -v    print version\n"
+	       "  --cache-stats        print cache usage and exit\n"
+	       "  --cache-size=MB      cache size budget, default %d\n"
+	       "  --synthetic=N        add synthetic provider with N entries to the menu\n"
+	       "  --synthetic-children=N  children per entry up to N, default 100\n"
+	       "  --synthetic-latency=MS  latency of synthetic provider calls\n",
+	       CACHE_SIZE_MB
 	       );
 }
 
@@ -52,27 +75,95 @@ version()
 
 static bool dumb_term = false;
 static bool activate_box = false;
+static bool download_now = false;
+static enum rlog_level log_level = RLOG_INFO;
+static bool cache_stats = false;
+static long long cache_size = CACHE_SIZE_MB * 1024LL * 1024LL;
+static int synthetic_entries = 0;
+static int synthetic_children = 100;
+static int synthetic_latency = 0;
 static char cache_dir[PATH_MAX];
 static char local_dir[PATH_MAX];
-static time_t idle_start = 0;
+static const int download_start_hour = 1;  /* offline downloads run at night */
+static const int download_end_hour = 7;
+static const long download_max_rate = 512 * 1024;
 static struct provider *provider; /* current provider */
 static struct movie_list *list;   /* current list of movies from provider */
+static struct movie_list *loaded; /* as loaded, list is one of its tabs if it has them */
+static const int list_refresh_sec = 600;
 //static struct termios orig_termios;
 
+/* one file per response was replaced by cache.pack */
+static void
+remove_legacy_cache()
+{
+	static const char *prefixes[] = { "stream-", "child-", "fav-", "smithsonian-", "cache.idx" };
+	char fname[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+	int i;
+
+	d = opendir(cache_dir);
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		for (i = 0; i < (int)(sizeof(prefixes) / sizeof(prefixes[0])); i++) {
+			if (strncmp(de->d_name, prefixes[i], strlen(prefixes[i])) == 0) {
+				snprintf(fname, sizeof(fname), "%s%s", cache_dir, de->d_name);
+				unlink(fname);
+				break;
+			}
+		}
+	}
+	closedir(d);
+}
+
 static void
 init(int argc, char **argv)
 {
 	int ch;
+	static struct option long_options[] = {
+		{ "cache-stats", no_argument,       NULL, 'S' },
+		{ "cache-size",  required_argument, NULL, 's' },
+		{ "synthetic",   required_argument, NULL, 'y' },
+		{ "synthetic-children", required_argument, NULL, 'Y' },
+		{ "synthetic-latency",  required_argument, NULL, 'L' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	while (optind < argc) {
 
-		ch = getopt(argc, argv, "ahv");
+		ch = getopt_long(argc, argv, "adDhT:v", long_options, NULL);
 		if (ch == -1)
 			continue;
 		switch (ch) {
 			case 'a':
 				activate_box = true;
 				break;
+			case 'd':
+				log_level = RLOG_DEBUG;
+				break;
+			case 'D':
+				download_now = true;
+				break;
+			case 'T':
+				trace_init(optarg);
+				break;
+			case 'S':
+				cache_stats = true;
+				break;
+			case 's':
+				cache_size = atoll(optarg) * 1024LL * 1024LL;
+				break;
+			case 'y':
+				synthetic_entries = atoi(optarg);
+				break;
+			case 'Y':
+				synthetic_children = atoi(optarg);
+				break;
+			case 'L':
+				synthetic_latency = atoi(optarg);
+				break;
 			case 'h':
 				usage();
 				exit(1);
@@ -86,13 +177,17 @@ init(int argc, char **argv)
 	mkdir(cache_dir, 0700);
 	strcat(cache_dir, "etvcc/");
 	mkdir(cache_dir, 0700);
+	remove_legacy_cache();
+
+	char pack_fname[PATH_MAX];
+	snprintf(pack_fname, PATH_MAX-1, "%scache.pack", cache_dir);
+	pack_open(pack_fname, cache_size);
 
 	snprintf(local_dir, PATH_MAX-1, "%s/.local/", getenv("HOME"));
 	mkdir(local_dir, 0700);
 	strcat(local_dir, "etvcc/");
 	mkdir(local_dir, 0700);
 
-	idle_start = time(NULL);
 	const char *term = getenv("TERM");
 	dumb_term = (term == NULL) || (strlen(term) == 0);
 }
@@ -117,7 +212,7 @@ init_ui(struct ui *ui)
 	initscr();
 	start_color();
 	getmaxyx(stdscr, ui->height, ui->width);
-	logi("height: %d, width: %d", ui->height, ui->width);
+	rlogi("height: %d, width: %d", ui->height, ui->width);
 	init_pair(1, COLOR_RED, COLOR_BLACK);
 	init_pair(2, COLOR_WHITE, COLOR_RED);
 	init_pair(3, COLOR_YELLOW, COLOR_BLUE);
@@ -129,11 +224,23 @@ init_ui(struct ui *ui)
 
 struct ui ui;
 
+static void
+print_tabs()
+{
+	int i;
+
+	for (i = 0; i < loaded->tabs_count; i++)
+		printf("%s%d-%s ", (i == loaded->tab) ? "*" : "", i + 1, loaded->tabs[i]->title);
+	printf("\n");
+}
+
 static void
 print_list()
 {
 	int i;
 	printf("=====================\n");
+	if (loaded->tabs_count > 0)
+		print_tabs();
 	for (i = 0; i < list->count; i++) {
 		const char *sel = " ";
 		struct movie_entry *e = list->items[i];
@@ -153,6 +260,58 @@ print_list()
 	}
 }
 
+static int list_top;  /* first visible entry */
+
+/* list rows between the header and the status line */
+static int
+list_rows()
+{
+	int rows = ui.height - 9;
+
+	return (rows > 0) ? rows : 1;
+}
+
+/* tab titles on the line above the list, the selected one highlighted */
+static void
+draw_tabs()
+{
+	int i, x = 2;
+	char title[64];
+
+	wmove(ui.win, 1, 1);
+	wclrtoeol(ui.win);
+
+	for (i = 0; i < loaded->tabs_count && x < 70; i++) {
+		snprintf(title, sizeof(title), "%d-%s", i + 1, loaded->tabs[i]->title);
+
+		if (i == loaded->tab)
+			wattron(ui.win, COLOR_PAIR(1) | A_BOLD);
+		mvwaddstr(ui.win, 1, x, title);
+		if (i == loaded->tab)
+			wattroff(ui.win, COLOR_PAIR(1) | A_BOLD);
+
+		x = getcurx(ui.win) + 1;
+	}
+}
+
+/* date and duration of the selected part onto the entry, kept while sel stays */
+static void
+find_part(struct movie_entry *e)
+{
+	struct movie_entry *part = provider->find_movie(e->id, e->sel);
+
+	free(e->part_on_air);
+	e->part_on_air = NULL;
+	if (part == NULL)
+		return;
+
+	e->part_on_air = part->on_air;
+	e->part_duration = part->duration;
+	e->part_sel = e->sel;
+	part->on_air = NULL;
+	free_movie(part);
+}
+
 static void
 draw_list()
 {
@@ -161,49 +320,77 @@ draw_list()
 		return;
 	}
 
-	box(ui.win, 0, 0);
+	int rows = list_rows();
+	int r;
 
-	int i;
-	for (i = 0; i < list->count; i++) {
+	if (loaded->tabs_count > 0)
+		draw_tabs();
+
+	if (list->sel < list_top)
+		list_top = list->sel;
+	else if (list->sel >= list_top + rows)
+		list_top = list->sel - rows + 1;
+
+	/* only visible entries, lists may have 100k of them */
+	for (r = 0; r < rows; r++) {
+		int i = list_top + r;
+		int y = r + 2;
+
+		wmove(ui.win, y, 1);
+		wclrtoeol(ui.win);
+
+		if (i >= list->count)
+			continue;
 
 		if (i == list->sel && ui.scroll == eNames) {
 			wattron(ui.win, COLOR_PAIR(1));
-			mvwaddstr(ui.win, i+2, 2, "[");
+			mvwaddstr(ui.win, y, 2, "[");
 		} else {
-			mvwaddstr(ui.win, i+2, 2, " ");
+			mvwaddstr(ui.win, y, 2, " ");
 		}
 
 		struct movie_entry *e = list->items[i];
-		mvwaddstr(ui.win, i+2, 4, e->name);
+		mvwaddstr(ui.win, y, 4, e->name);
 
 		if (i == list->sel && ui.scroll == eNames) {
-			mvwaddstr(ui.win, i+2, 45, "] ");
+			mvwaddstr(ui.win, y, 45, "] ");
 			wattroff(ui.win, COLOR_PAIR(1));
 		} else {
-			mvwaddstr(ui.win, i+2, 45, "  ");
+			mvwaddstr(ui.win, y, 45, "  ");
 		}
 
-//		mvwaddstr(ui.win, i+2, 39, "      ");
-
 		if (i == list->sel && ui.scroll == eNumbers) {
 			wattron(ui.win, COLOR_PAIR(1));
-			mvwprintw(ui.win, i+2, 47, "%d/%d     ", e->sel + 1, e->children_count);
-			mvwaddstr(ui.win, i+2, 45, "[");
-			mvwaddstr(ui.win, i+2, 52, "]");
+			mvwprintw(ui.win, y, 47, "%d/%d     ", e->sel + 1, e->children_count);
+			mvwaddstr(ui.win, y, 45, "[");
+			mvwaddstr(ui.win, y, 52, "]");
 			wattroff(ui.win, COLOR_PAIR(1));
 		} else {
-			mvwprintw(ui.win, i+2, 47, "%d/%d     ", e->sel + 1, e->children_count);
+			mvwprintw(ui.win, y, 47, "%d/%d     ", e->sel + 1, e->children_count);
 		}
 
-		mvwaddstr(ui.win, i+2, 54, e->on_air);
+		mvwaddstr(ui.win, y, 54, e->on_air);
+
+		/* date of the selected part once the series is indexed */
+		if (e->children_count > 0 && provider->find_movie != NULL) {
+			if (e->part_on_air == NULL || e->part_sel != e->sel)
+				find_part(e);
+			if (e->part_on_air != NULL) {
+				mvwaddstr(ui.win, y, 54, e->part_on_air);
+				if (e->part_duration > 0)
+					wprintw(ui.win, " %d'", e->part_duration);
+			}
+		}
 	}
+
+	box(ui.win, 0, 0);
+	if (list->count > rows)
+		mvwprintw(ui.win, 0, 2, " %d/%d ", list->sel + 1, list->count);
 }
 
 static void
-print_status(const char *msg)
+draw_status(const char *msg)
 {
-	if (strlen(msg) > 0)
-		logi(msg);
 	if (dumb_term) {
 		printf("status: %s\n", msg);
 	} else {
@@ -215,6 +402,14 @@ print_status(const char *msg)
 	}
 }
 
+static void
+print_status(const char *msg)
+{
+	if (strlen(msg) > 0)
+		rlogi("%s", msg);
+	draw_status(msg);
+}
+
 enum menu_id {
 	MI_ETVNET,
 	MI_SMITHSONIAN,
@@ -224,7 +419,8 @@ enum menu_id {
 	MI_CLEAN,
 	MI_REDRAW,
 	MI_SHUTDOWN,
-	MI_REBOOT
+	MI_REBOOT,
+	MI_SYNTHETIC
 };
 
 
@@ -248,7 +444,8 @@ static struct menu_entry menu_items[] = {
 	{ MI_CLEAN, "clean" },
 	{ MI_REDRAW, "redraw" },
 	{ MI_SHUTDOWN, "shutdown" },
-	{ MI_REBOOT, "reboot" }
+	{ MI_REBOOT, "reboot" },
+	{ MI_SYNTHETIC, "synthetic" }      /* last, shown with --synthetic */
 };
 
 static struct menu_list menu = {
@@ -257,6 +454,74 @@ static struct menu_list menu = {
 	.items = menu_items
 };
 
+enum session_state {
+	SS_NONE,        /* not loaded or the last load failed */
+	SS_LOADING,
+	SS_READY
+};
+
+/*
+ * Every provider of the menu is loaded in the background from the start and
+ * stays with its list for the process lifetime, a visit shows the list as it
+ * was left. A loader thread fills the session, until it is ready the state
+ * is read under sessions_lock.
+ */
+struct session {
+	enum session_state state;
+	bool failed;                   /* the last load */
+	bool shown;                    /* selections applied */
+	struct provider *provider;
+	struct movie_list *loaded;     /* NULL until loaded */
+	struct movie_list *list;
+	int list_top;
+	time_t loaded_at;              /* of the load or the last refresh */
+	bool refreshing;               /* changes are fetched in the background */
+	bool fetched;                  /* and wait in changes, under sessions_lock */
+	struct list_changes *changes;
+};
+
+static struct session sessions[MI_SYNTHETIC + 1];
+static struct session *session;    /* shown, NULL in the menu */
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_cond = PTHREAD_COND_INITIALIZER;  /* a load is done */
+static const int loading_poll_ms = 200;
+
+static enum session_state
+session_state(const struct session *s)
+{
+	pthread_mutex_lock(&sessions_lock);
+	enum session_state state = s->state;
+	pthread_mutex_unlock(&sessions_lock);
+
+	return state;
+}
+
+/* loading or refreshing, on the ui thread */
+static bool
+sessions_busy()
+{
+	int i;
+
+	for (i = 0; i < (int)(sizeof(sessions) / sizeof(sessions[0])); i++) {
+		if (session_state(&sessions[i]) == SS_LOADING || sessions[i].refreshing)
+			return true;
+	}
+
+	return false;
+}
+
+static const char *
+session_label(const struct session *s)
+{
+	pthread_mutex_lock(&sessions_lock);
+	const char *label = (s->state == SS_LOADING) ? "Loading " :
+			    (s->state == SS_READY) ? "Ready   " :
+			    (s->failed) ? "Failed  " : "        ";
+	pthread_mutex_unlock(&sessions_lock);
+
+	return label;
+}
+
 static bool camera_enabled = false;
 
 static void
@@ -297,6 +562,8 @@ draw_menu()
 		} else if (e->id == MI_UPDATE) {
 			snprintf(buf, 99, "%s (%s %s)", app_version, __DATE__, __TIME__);
 			str = buf;
+		} else if (e->id == MI_ETVNET || e->id == MI_SMITHSONIAN || e->id == MI_SYNTHETIC) {
+			str = session_label(&sessions[e->id]);
 		}
 
 		mvwaddstr(ui.win, i+2, 24, str);
@@ -373,7 +640,8 @@ exit_handler()
 		endwin();
 	}
 
-	logi("stopped");
+	rlogi("stopped");
+	rlog_flush();
 	system("tail -100 ctv.log");
 }
 
@@ -392,7 +660,7 @@ run_player(const char *url)
 		snprintf(omxcmd, 1999, "mplayer -msglevel all=0 -cache-min 64 '%s' 2>/dev/null 1>&2", url);
 	}
 
-	logi("starting player: %s", omxcmd);
+	rlogi("starting player: %s", omxcmd);
 	ch = KEY_RIGHT;
 
 	while (!quit) {
@@ -407,7 +675,7 @@ run_player(const char *url)
 				if (player_started == 1) {
 					print_status("stop");
 					rc = system("/home/pi/src/ctv/dbuscontrol.sh stop >/dev/null 2>&1");
-					logi("dbus.stop. rc: %d\r", rc);
+					rlogi("dbus.stop. rc: %d\r", rc);
 					player_started = 0;
 				}
 				quit = 1;
@@ -415,67 +683,139 @@ run_player(const char *url)
 			case KEY_RIGHT:
 				if (player_started == 0) {
 					print_status("start");
+					trace_begin("player_spawn");
 					rc = system(omxcmd);
+					trace_end("player_spawn");
 					if (rc == 0)
 						player_started = 1;
-					logi("start omxplayer. rc: %d\r", rc);
+					rlogi("start omxplayer. rc: %d\r", rc);
 				} else if (player_started == 1) {
 					print_status("move forward 60 sec");
 					rc = system("/home/pi/src/ctv/dbuscontrol.sh seek 60000000 >/dev/null 2>&1");
-					logi("dbus.seek. rc: %d\r", rc);
+					rlogi("dbus.seek. rc: %d\r", rc);
 				}
 				break;
 			case KEY_DOWN:
 				print_status("volume down");
 				rc = system("/home/pi/src/ctv/dbuscontrol.sh volumedown >/dev/null 2>&1");
-				logi("dbus.volumedown. rc: %d\r", rc);
+				rlogi("dbus.volumedown. rc: %d\r", rc);
 				break;
 			case KEY_UP:
 				print_status("volume up");
 				rc = system("/home/pi/src/ctv/dbuscontrol.sh volumeup >/dev/null 2>&1");
-				logi("dbus.volumeup. rc: %d\r", rc);
+				rlogi("dbus.volumeup. rc: %d\r", rc);
 				break;
 		}
 	}
 
 	print_status("player stopped");
 
+	/* watching is not idling */
+	power_key();
+
 }
 
-static void
-play_movie()
+/* selected movie or its selected part. Parts are freed by free_selected() */
+static struct movie_entry *
+get_selected_movie()
 {
-	print_status("Loading movie...");
-
 	struct movie_entry *e = list->items[list->sel];
-	if (e->children_count == 0) {
-		char *url = e->stream_url;
-		if (url == NULL) {
-			url = provider->get_stream_url(e);
-			if (provider->error_number != 0)
-				statusf("no stream url: %s", provider->error());
-		}
-		run_player(url);
-		free(url);
-		return;
-	}
+	if (e->children_count == 0)
+		return e;
 
 	struct movie_entry *child = provider->get_movie(e->id, e->sel);
 	if (provider->error_number != 0) {
 		statusf("part %d: %s", e->sel, provider->error());
-		return;
+		return NULL;
 	}
 
-	char *url = provider->get_stream_url(child);
+	return child;
+}
+
+static void
+free_selected(struct movie_entry *m)
+{
+	if (m != list->items[list->sel])
+		free_movie(m);
+}
+
+static char *
+get_remote_url(struct movie_entry *m)
+{
+	if (m->stream_url != NULL)
+		return strdup(m->stream_url);
+
+	char *url = provider->get_stream_url(m);
 	if (provider->error_number != 0)
-		statusf("play_movie[%d]: %s", e->sel, provider->error());
-	logi("id: %d, url: %s", child->id, url);
-	print_status("Playing movie...");
-	run_player(url);
-	free(child);
+		statusf("no stream url[%d]: %s", m->id, provider->error());
+
+	return url;
+}
+
+static void
+play_movie()
+{
+	print_status("Loading movie...");
+
+	struct movie_entry *m = get_selected_movie();
+	if (m == NULL)
+		return;
+
+	char *url = download_local_path(provider->name, m->id);
+	if (url == NULL)
+		url = get_remote_url(m);
+
+	if (url != NULL) {
+		rlogi("id: %d, url: %s", m->id, url);
+		print_status("Playing movie...");
+		metrics_since(H_PLAY_START, joystick_key_time());
+		run_player(url);
+	}
+
+	free_selected(m);
 	free(url);
 }
 
+static void
+download_movie()
+{
+	print_status("Queueing movie...");
+
+	struct movie_entry *m = get_selected_movie();
+	if (m == NULL)
+		return;
+
+	/* the stream url is resolved at night when the download starts */
+	download_queue(provider->name, m);
+	statusf("queued for download: %s", m->name);
+
+	free_selected(m);
+}
+
+/* runs on the download thread, the provider is the one of the menu or a new one */
+static char *
+download_url(const char *provider_name, struct movie_entry *m)
+{
+	struct provider *p;
+
+	if (strcmp(provider_name, "etvnet") == 0)
+		p = etvnet_get_provider();
+	else if (strcmp(provider_name, "smithsonian") == 0)
+		p = smithsonian_get_provider();
+	else
+		return NULL;
+
+	if (p->get_stream_url == NULL)
+		return NULL;
+
+	char *url = p->get_stream_url(m);
+	if (url == NULL)
+		rlogw("no stream url for %s-%d: %s", provider_name, m->id,
+		      (p->error() != NULL) ? p->error() : "unknown");
+
+	return url;
+}
+
 static void
 activate_tv_box()
 {
@@ -506,154 +846,721 @@ activate_tv_box()
 	exit(0);
 }
 
+/* every tab has its own selections */
 static void
-save_selections(const char *name)
+selections_fname(char *fname)
 {
-	int i;
-	char fname[PATH_MAX];
-	FILE *f;
-	struct movie_entry *e;
+	char title[64];
+	char *p;
 
-	snprintf(fname, PATH_MAX-1, "%sselections-%s.txt", local_dir, name);
-	f = fopen(fname, "wt");
-	if (f == NULL)
-		statusf("cannot save selections");
+	if (loaded == NULL || loaded->tabs_count == 0) {
+		snprintf(fname, PATH_MAX-1, "%sselections-%s.txt", local_dir, provider->name);
+		return;
+	}
 
-	fprintf(f, "list.sel = %d\n", list->sel);
-	for (i = 0; i < list->count; i++) {
-		e = list->items[i];
-		fprintf(f, "movie.%d.sel = %d\n", e->id, e->sel);
+	snprintf(title, sizeof(title), "%s", list->title);
+	for (p = title; *p; p++) {
+		if (*p == '/')
+			*p = '_';
 	}
+	snprintf(fname, PATH_MAX-1, "%sselections-%s-%s.txt", local_dir, provider->name, title);
+}
+
+/* of the last save, the file is only written when they move */
+static struct {
+	const struct movie_list *list;
+	int sel;
+	int id;
+	int part;
+} saved_selection;
+
+static void
+save_selections()
+{
+	char fname[PATH_MAX];
+	bool has = list->sel < list->count;
+	int id = has ? list->items[list->sel]->id : -1;
+	int part = has ? list->items[list->sel]->sel : -1;
+
+	if (saved_selection.list == list && saved_selection.sel == list->sel &&
+	    saved_selection.id == id && saved_selection.part == part)
+		return;
 
-	fclose(f);
+	selections_fname(fname);
+	if (selections_save(fname, list) != 0)
+		statusf("cannot save selections");
+
+	saved_selection.list = list;
+	saved_selection.sel = list->sel;
+	saved_selection.id = id;
+	saved_selection.part = part;
 }
 
 static void
-load_selections(const char *name)
+load_selections()
 {
-	int i, n, v, id, j;
 	char fname[PATH_MAX];
-	FILE *f;
-	struct movie_entry *e;
+	struct stat st;
+
+	selections_fname(fname);
 
-	snprintf(fname, PATH_MAX-1, "%sselections-%s.txt", local_dir, name);
-	f = fopen(fname, "rt");
-	if (f == NULL)
+	/* saved before the tabs, entries are matched by id */
+	if (stat(fname, &st) != 0)
+		snprintf(fname, PATH_MAX-1, "%sselections-%s.txt", local_dir, provider->name);
+
+	selections_load(fname, list);
+}
+
+static void
+select_tab(int tab)
+{
+	if (loaded == NULL || tab < 0 || tab >= loaded->tabs_count)
 		return;
 
-	n = fscanf(f, "list.sel = %d\n", &v);
-	if (n != 1) {
-		fclose(f);
+	loaded->tab = tab;
+	list = loaded->tabs[tab];
+	list_top = 0;
+	load_selections();
+}
+
+/* key waiting for the refresh that shows its result */
+static struct {
+	uint64_t stamp;         /* joystick_key_time() of the key, 0 if none */
+	const char *key;
+	const char *screen;
+} pending_key;
+
+static const char *
+key_label(int ch)
+{
+	switch (ch) {
+		case KEY_UP:    return "key=up";
+		case KEY_DOWN:  return "key=down";
+		case KEY_LEFT:  return "key=left";
+		case KEY_RIGHT: return "key=right";
+		case KEY_HOME:  return "key=home";
+		default:        return "key=other";
+	}
+}
+
+/* set before the handler runs, handlers may draw screens of their own */
+static void
+key_pending(int ch, const char *screen)
+{
+	if (ch == -1)
 		return;
+
+	pending_key.stamp = joystick_key_time();
+	pending_key.key = key_label(ch);
+	pending_key.screen = screen;
+}
+
+/* called after wrefresh() */
+static void
+frame_done()
+{
+	power_ui_ready();
+
+	if (pending_key.stamp == 0)
+		return;
+
+	/* keys were read in between, e.g. by the player */
+	if (pending_key.stamp == joystick_key_time()) {
+		uint64_t usec = metrics_now() - pending_key.stamp;
+		metrics_time(H_KEY_TO_PIXEL, usec);
+		metrics_time_label(H_KEY_TO_PIXEL, pending_key.key, usec);
+		metrics_time_label(H_KEY_TO_PIXEL, pending_key.screen, usec);
 	}
 
-	if (v >= 0 && v < list->count)
-		list->sel = v;
+	pending_key.stamp = 0;
+}
 
-	for (i = 0; i < list->count; i++) {
-		n = fscanf(f, "movie.%d.sel = %d\n", &id, &v);
-		if (n != 2)
-			break;
+static bool screen_erased;      /* by get_key(), the list is drawn again */
 
-		for (j = 0; j < list->count; j++) {
-			e = list->items[j];
-			if (e->id == id && v < e->children_count) {
-				e->sel = v;
-				break;
-			}
-		}
+/* wait for a key with monitor power management, -1 on timeout */
+static int
+get_key()
+{
+	int timeout = power_timeout();
+
+	/* background loads and refreshes are shown as they finish */
+	if (!dumb_term && sessions_busy() &&
+	    (timeout < 0 || timeout > loading_poll_ms))
+		timeout = loading_poll_ms;
+
+	int ch = joystick_getch_timeout(timeout);
+
+	power_tick();
+
+	if (ch != -1 && power_key())
+		ch = -1;
+
+	if (power_redraw()) {
+		erase();
+		refresh();
+		touchwin(ui.win);
+		screen_erased = true;
 	}
 
-	fclose(f);
-	logi("selections loaded");
+	return ch;
+}
+
+#define MAX_RESULTS 100
+
+/* entry or part behind every name of the search index */
+struct search_doc {
+	int tab;
+	int item;
+	int part;            /* -1 for the entry itself */
+	int parts;           /* of the entry, added so far */
+	int id;              /* of the entry, it finds the item again after a refresh */
+	struct movie_list *list;   /* of the tab */
+	bool removed;
+};
+
+static struct search_index *search;   /* of loaded, NULL until the first search */
+static struct search_doc *search_docs;
+static int search_docs_capacity;
+
+static struct movie_list *
+tab_list(int tab)
+{
+	return (loaded->tabs_count > 0) ? loaded->tabs[tab] : loaded;
 }
 
 static void
-turnoff_monitor()
+add_doc(int tab, int item, int part, const char *name)
 {
-	const char *cmd = "/opt/vc/bin/tvservice -o >> tvservice.log 2>&1";
-	logi("turning off monitor");
-	int rc = system(cmd);
-	if (rc != 0)
-		logwarn("error: %d. You may need to set chmod u+s /opt/vc/bin/tvservice", rc);
-	else
-		print_status("monitor is off");
+	int id = search_add(search, name);
+
+	if (id >= search_docs_capacity) {
+		search_docs_capacity = (search_docs_capacity == 0) ? 256 : search_docs_capacity * 2;
+		search_docs = realloc(search_docs, sizeof(struct search_doc) * search_docs_capacity);
+	}
+	search_docs[id] = (struct search_doc){ tab, item, part, 0, tab_list(tab)->items[item]->id, tab_list(tab), false };
 }
 
 static void
-turnon_monitor()
+remove_doc(int id)
 {
-	const char *cmd =
-		"/opt/vc/bin/tvservice -p >> tvservice.log 2>&1; "
-		"sleep 5; setterm --reset >> tvservice.log";
-	logi("turning on monitor");
-	int rc = system(cmd);
-	if (rc != 0)
-		logwarn("error: %d. You may need to set chmod u+s /opt/vc/bin/tvservice", rc);
-	else
-		print_status("monitor is on");
+	search_remove(search, id);
+	search_docs[id].removed = true;
 }
 
+/* entries are added once per load, parts as the provider indexes them */
 static void
-on_idle()
+search_update()
 {
-	int ch = -1;
+	struct movie_entry *e, *m;
+	int t, i, id, count;
+
+	if (search == NULL) {
+		search = search_new();
+		for (t = 0; t < ((loaded->tabs_count > 0) ? loaded->tabs_count : 1); t++) {
+			for (i = 0; i < tab_list(t)->count; i++)
+				add_doc(t, i, -1, tab_list(t)->items[i]->name);
+		}
+	}
 
-	time_t idle_interval = time(NULL) - idle_start;
+	if (provider->find_movie == NULL)
+		return;
+
+	count = search_count(search);
+	for (id = 0; id < count; id++) {
+		if (search_docs[id].part != -1 || search_docs[id].removed)
+			continue;
 
-	if (idle_interval < 5*60) {
-		logi("on idle: %ju sec", idle_interval);
+		e = tab_list(search_docs[id].tab)->items[search_docs[id].item];
+		while (search_docs[id].parts < e->children_count) {
+			m = provider->find_movie(e->id, search_docs[id].parts);
+			if (m == NULL)
+				break;
+
+			add_doc(search_docs[id].tab, search_docs[id].item, search_docs[id].parts, m->name);
+			search_docs[id].parts++;
+			free_movie(m);
+		}
+	}
+}
+
+struct item_id {
+	int id;
+	int item;
+};
+
+static int
+by_item_id(const void *a, const void *b)
+{
+	const struct item_id *x = a, *y = b;
+
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+/* current tab and item of the entry of the doc, false if it left the lists */
+static bool
+locate_doc(struct search_doc *d, struct item_id **ids, int tabs)
+{
+	struct item_id key = { d->id, 0 }, *found;
+	int t;
+
+	for (t = 0; t < tabs && tab_list(t) != d->list; t++)
+		;
+	if (t == tabs)
+		return false;
+
+	found = bsearch(&key, ids[t], tab_list(t)->count, sizeof(key), by_item_id);
+	if (found == NULL)
+		return false;
+
+	d->tab = t;
+	d->item = found->item;
+	return true;
+}
+
+/*
+ * After a refresh: names of entries that left the lists or were renamed
+ * are removed, new entries are added, the rest follow their entry. Parts
+ * are dropped with their entry or when it has fewer of them now, and are
+ * added again by search_update.
+ */
+static void
+search_merge()
+{
+	int tabs = (loaded->tabs_count > 0) ? loaded->tabs_count : 1;
+	struct item_id **ids;
+	int **owner;            /* doc of every item, -1 if none */
+	int t, i, id, count;
+
+	if (search == NULL)
 		return;
+
+	ids = calloc(tabs, sizeof(struct item_id *));
+	owner = calloc(tabs, sizeof(int *));
+	for (t = 0; t < tabs; t++) {
+		struct movie_list *l = tab_list(t);
+
+		ids[t] = malloc(sizeof(struct item_id) * (l->count + 1));
+		owner[t] = malloc(sizeof(int) * (l->count + 1));
+		for (i = 0; i < l->count; i++) {
+			ids[t][i] = (struct item_id){ l->items[i]->id, i };
+			owner[t][i] = -1;
+		}
+		qsort(ids[t], l->count, sizeof(struct item_id), by_item_id);
 	}
 
-	turnoff_monitor();
-	while (ch == -1) {
-		logi("wait for any key");
-		ch = joystick_getch();
+	/* parts come after the doc of their entry */
+	count = search_count(search);
+	for (id = 0; id < count; id++) {
+		struct search_doc *d = &search_docs[id];
+
+		if (d->removed)
+			continue;
+
+		if (!locate_doc(d, ids, tabs)) {
+			remove_doc(id);
+			continue;
+		}
+
+		struct movie_entry *e = tab_list(d->tab)->items[d->item];
+		int *o = &owner[d->tab][d->item];
+
+		if (d->part == -1) {
+			if (*o != -1 || !search_same_name(search, id, e->name)) {
+				remove_doc(id);
+				continue;
+			}
+			if (d->parts > e->children_count)
+				d->parts = 0;
+			*o = id;
+		} else if (*o == -1 || d->part >= search_docs[*o].parts) {
+			remove_doc(id);
+		}
 	}
-	turnon_monitor();
-	erase();
-	refresh();
-	idle_start = time(NULL);
+
+	for (t = 0; t < tabs; t++) {
+		for (i = 0; i < tab_list(t)->count; i++) {
+			if (owner[t][i] == -1)
+				add_doc(t, i, -1, tab_list(t)->items[i]->name);
+		}
+		free(ids[t]);
+		free(owner[t]);
+	}
+	free(ids);
+	free(owner);
 }
 
 static void
-provider_loop(enum menu_id provider_id)
+show_doc(const struct search_doc *d)
 {
-	int quit = 0;
+	if (loaded->tabs_count > 0 && d->tab != loaded->tab)
+		select_tab(d->tab);
+	list->sel = d->item;
+}
+
+/* type-ahead search, the selection follows the current match */
+static void
+search_loop()
+{
+	char query[256] = "", msg[300];
+	const char *text;
+	int ids[MAX_RESULTS], count = 0, cur = 0, len, ch;
+	int tab = (loaded->tabs_count > 0) ? loaded->tab : 0, sel = list->sel;
+	bool changed = false, done = false;
+
+	uint64_t start = metrics_now();
+	search_update();
+	rlogi("search over %d names, updated in %llu us", search_count(search),
+	      (unsigned long long)(metrics_now() - start));
+
+	while (!done) {
+		if (changed) {
+			start = metrics_now();
+			count = search_find(search, query, ids, MAX_RESULTS);
+			metrics_since(H_SEARCH, start);
+			cur = 0;
+			changed = false;
+		}
+
+		if (count > 0) {
+			struct search_doc *d = &search_docs[ids[cur]];
+			show_doc(d);
+			if (d->part >= 0)
+				snprintf(msg, sizeof(msg), "/%s  %d/%d  part %d", query, cur + 1, count, d->part + 1);
+			else
+				snprintf(msg, sizeof(msg), "/%s  %d/%d", query, cur + 1, count);
+		} else {
+			snprintf(msg, sizeof(msg), "/%s%s", query, query[0] ? "  not found" : "");
+		}
+
+		draw_list();
+		draw_status(msg);
+		wrefresh(ui.win);
+		frame_done();
+
+		ch = get_key();
+		key_pending(ch, "screen=search");
+		if (ch == -1)
+			continue;
+
+		/* keyboard text goes to the query, buttons and arrows move */
+		text = joystick_text();
+		len = strlen(query);
+		if (text[0] == 27 && text[1] == '[') {
+			switch (text[2]) {
+				case 'A': ch = KEY_UP; break;
+				case 'B': ch = KEY_DOWN; break;
+				case 'C': ch = KEY_RIGHT; break;
+				default:  ch = KEY_LEFT; break;
+			}
+		} else if (text[0] == 27) {
+			ch = KEY_LEFT;
+		} else if (text[0] == '\r' || text[0] == '\n') {
+			ch = KEY_RIGHT;
+		} else if (text[0] == 127 || text[0] == 8) {
+			/* whole utf-8 character */
+			while (len > 0 && (query[--len] & 0xc0) == 0x80)
+				;
+			query[len] = 0;
+			changed = true;
+			ch = -1;
+		} else if ((unsigned char)text[0] >= ' ') {
+			if (len + strlen(text) < sizeof(query))
+				strcat(query, text);
+			changed = true;
+			ch = -1;
+		}
+
+		switch (ch) {
+			case KEY_UP:
+				if (count > 0)
+					cur = (cur + count - 1) % count;
+				break;
+			case KEY_DOWN:
+				if (count > 0)
+					cur = (cur + 1) % count;
+				break;
+			case KEY_RIGHT:
+				/* a part opens with the part selected */
+				if (count > 0 && search_docs[ids[cur]].part >= 0) {
+					list->items[list->sel]->sel = search_docs[ids[cur]].part;
+					ui.scroll = eNumbers;
+				}
+				done = true;
+				break;
+			case KEY_LEFT:
+				if (loaded->tabs_count > 0 && tab != loaded->tab)
+					select_tab(tab);
+				list->sel = sel;
+				done = true;
+				break;
+		}
+
+		metrics_since(H_KEY_ACTION, joystick_key_time());
+	}
 
-	if (provider_id == MI_ETVNET) {
-		print_status("Connecting to etvnet.com");
-		provider = etvnet_get_provider();
+	print_status((ui.scroll == eNumbers) ? "<< LIST       PLAY >>" : "<< MENU    SELECT_PART >>");
+}
+
+static bool
+session_expired(const struct session *s)
+{
+	return s->loaded != NULL && s->provider->fetch_changes != NULL && !s->refreshing &&
+	       time(NULL) - s->loaded_at >= list_refresh_sec;
+}
+
+static void *
+refresher(void *arg)
+{
+	struct session *s = arg;
+
+	uint64_t start = metrics_now();
+	trace_begin("provider_refresh");
+	struct list_changes *changes = s->provider->fetch_changes(s->loaded);
+	trace_end("provider_refresh");
+	metrics_since(H_LIST_REFRESH, start);
+
+	pthread_mutex_lock(&sessions_lock);
+	s->changes = changes;
+	s->fetched = true;
+	pthread_mutex_unlock(&sessions_lock);
+
+	return NULL;
+}
+
+/* the list stays usable while its changes are fetched */
+static void
+start_refresh(struct session *s)
+{
+	pthread_t tid;
+
+	if (s->loaded == NULL || s->provider->fetch_changes == NULL || s->refreshing)
+		return;
 
-	} else if (provider_id == MI_SMITHSONIAN) {
-		print_status("Connecting to smithsonian.com");
-		provider = smithsonian_get_provider();
+	s->refreshing = true;
+	pthread_create(&tid, NULL, refresher, s);
+	pthread_detach(tid);
+}
+
+/* applies the fetched changes to the list of s, false if none are fetched yet */
+static bool
+apply_refresh(struct session *s, int *changes)
+{
+	pthread_mutex_lock(&sessions_lock);
+	bool fetched = s->fetched;
+	struct list_changes *c = s->changes;
+	s->fetched = false;
+	s->changes = NULL;
+	pthread_mutex_unlock(&sessions_lock);
+
+	if (!fetched)
+		return false;
+
+	s->refreshing = false;
+	s->loaded_at = time(NULL);
+	*changes = s->provider->apply_changes(s->loaded, c);
+
+	/* the shown tab may be gone */
+	if (*changes > 0 && s->loaded->tabs_count > 0 &&
+	    s->list != s->loaded->tabs[s->loaded->tab]) {
+		s->list = s->loaded->tabs[s->loaded->tab];
+		s->list_top = 0;
 	}
 
+	return true;
+}
+
+/*
+ * Brings the shown list up to date in place once fetched, the selection
+ * stays. Returns true if the list changed.
+ */
+static bool
+refresh_list()
+{
+	int changes;
+
+	session->list = list;
+	if (!apply_refresh(session, &changes))
+		return false;
+
 	if (provider->error_number != 0)
 		statusf("%s", provider->error());
+	if (changes <= 0)
+		return false;
+
+	if (list != session->list)
+		select_tab(loaded->tab);
+	search_merge();
+
+	statusf("list updated, %d changes", changes);
+	return true;
+}
+
+/* the expired lists of the providers not shown are refreshed in the background */
+static void
+refresh_sessions()
+{
+	int i, changes;
+
+	for (i = 0; i < (int)(sizeof(sessions) / sizeof(sessions[0])); i++) {
+		struct session *s = &sessions[i];
+
+		if (session_state(s) != SS_READY)
+			continue;
+
+		if (apply_refresh(s, &changes) && changes > 0)
+			rlogi("%s: list updated, %d changes", s->provider->name, changes);
+		if (session_expired(s))
+			start_refresh(s);
+	}
+}
+
+static struct provider *
+get_provider(enum menu_id provider_id)
+{
+	if (provider_id == MI_ETVNET)
+		return etvnet_get_provider();
+	if (provider_id == MI_SMITHSONIAN)
+		return smithsonian_get_provider();
+
+	return synthetic_get_provider();
+}
+
+/* token read and list load off the ui thread, the session is filled at the end */
+static void *
+loader(void *arg)
+{
+	struct session *s = arg;
+	struct provider *p = get_provider(s - sessions);
+
+	uint64_t start = metrics_now();
+	trace_begin("provider_load");
+	struct movie_list *l = p->load();
+	trace_end("provider_load");
+	metrics_since(H_LIST_LOAD, start);
+
+	if (p->error_number != 0)
+		rlogi("%s: %s", p->name, p->error());
+
+	pthread_mutex_lock(&sessions_lock);
+	s->provider = p;
+	s->loaded = l;
+	s->list = l;
+	s->list_top = 0;
+	s->loaded_at = time(NULL);
+	s->failed = (l == NULL);
+	s->state = (l != NULL) ? SS_READY : SS_NONE;
+	pthread_cond_broadcast(&sessions_cond);
+	pthread_mutex_unlock(&sessions_lock);
+
+	return NULL;
+}
+
+/* starts the load unless the session is loading or loaded, under sessions_lock */
+static void
+start_session(struct session *s)
+{
+	pthread_t tid;
+
+	if (s->state != SS_NONE)
+		return;
 
-	print_status("Loading movie list");
-	list = provider->load();
+	if (s == &sessions[MI_SYNTHETIC])
+		synthetic_config(synthetic_entries, synthetic_children, synthetic_latency);
 
+	s->state = SS_LOADING;
+	pthread_create(&tid, NULL, loader, s);
+	pthread_detach(tid);
+}
+
+/* the providers of the menu are loaded in parallel before one is picked */
+static void
+warm_up()
+{
+	int i;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (i = 0; i < menu.count; i++) {
+		enum menu_id id = menu.items[i].id;
+		if (id == MI_ETVNET || id == MI_SMITHSONIAN || id == MI_SYNTHETIC)
+			start_session(&sessions[id]);
+	}
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+static void
+provider_loop(enum menu_id provider_id)
+{
+	int quit = 0;
+	bool dirty = true;
+	uint64_t start;
+
+	/* a failed load is retried */
+	session = &sessions[provider_id];
+	pthread_mutex_lock(&sessions_lock);
+	start_session(session);
+	if (session->state == SS_LOADING)
+		print_status("Loading movie list");
+	while (session->state == SS_LOADING)
+		pthread_cond_wait(&sessions_cond, &sessions_lock);
+	pthread_mutex_unlock(&sessions_lock);
+
+	provider = session->provider;
 	if (provider->error_number != 0)
 		statusf("%s", provider->error());
 
-	load_selections(provider->name);
+	/* nothing to show, the menu tells it failed */
+	if (session->loaded == NULL) {
+		session = NULL;
+		return;
+	}
+
+	loaded = session->loaded;
+	list = session->list;
+	list_top = session->list_top;
+	search_free(search);
+	search = NULL;
+	if (!session->shown) {
+		session->shown = true;
+		if (loaded->tabs_count > 0)
+			select_tab(loaded->tab);
+		else
+			load_selections();
+	}
 
 	print_status("<< MENU    SELECT_PART >>");
 
 	while (!quit) {
-		draw_list();
-		save_selections(provider->name);
-		wrefresh(ui.win);
+		/* the entries changed, the selections file follows them */
+		if (refresh_list()) {
+			saved_selection.list = NULL;
+			dirty = true;
+		}
 
-		int ch = joystick_getch();
+		/* polls while loading come back without a key, nothing to draw */
+		if (dirty) {
+			start = metrics_now();
+			trace_begin("draw_list");
+			draw_list();
+			trace_end("draw_list");
+			metrics_since(H_DRAW_LIST, start);
+			save_selections();
+			wrefresh(ui.win);
+			frame_done();
+			dirty = false;
+		}
+
+		/* a kept list is shown and used while it is brought up to date */
+		if (session_expired(session))
+			start_refresh(session);
+
+		int ch = get_key();
+		key_pending(ch, (ui.scroll == eNames) ? "screen=list" : "screen=parts");
+		if (ch != -1 || screen_erased)
+			dirty = true;
+		screen_erased = false;
 
 		switch (ch) {
 			case -1:
-				on_idle();
 				break;
 			case 'q': case 'Q':
 				quit = 1;
@@ -678,6 +1585,23 @@ provider_loop(enum menu_id provider_id)
 					print_status("<< MENU    SELECT_PART >>");
 				}
 				break;
+			case KEY_HOME:
+				if (ui.scroll == eNumbers)
+					download_movie();
+				else if (loaded->tabs_count > 0)
+					select_tab((loaded->tab + 1) % loaded->tabs_count);
+				break;
+			case '1': case '2': case '3': case '4': case '5':
+			case '6': case '7': case '8': case '9':
+				select_tab(ch - '1');
+				break;
+			case '/':
+				if (loaded != NULL && ui.scroll == eNames)
+					search_loop();
+				break;
+			case 'r':
+				start_refresh(session);
+				break;
 			case KEY_RIGHT:
 				if (ui.scroll == eNumbers)
 					play_movie();
@@ -687,8 +1611,14 @@ provider_loop(enum menu_id provider_id)
 				}
 				break;
 		}
+
+		if (ch != -1)
+			metrics_since(H_KEY_ACTION, joystick_key_time());
 	}
 
+	session->list = list;
+	session->list_top = list_top;
+	session = NULL;
 	werase(ui.win);
 }
 
@@ -706,11 +1636,11 @@ switch_camera()
 			"--key-config /home/pi/bin/omxp_keys.txt http://192.168.1.1:14:8085"
 			">/dev/null 2>&1 &";
 		rc = system(cmd);
-		logi("camera on: %d", rc);
+		rlogi("camera on: %d", rc);
 	} else {
 		cmd = "/home/pi/src/ctv/dbuscontrol.sh stop >/dev/null 2>&1";
 		rc = system(cmd);
-		logi("camera off: %d", rc);
+		rlogi("camera off: %d", rc);
 	}
 }
 
@@ -738,6 +1668,10 @@ menu_action()
 		werase(ui.win);
 		provider_loop(MI_SMITHSONIAN);
 		break;
+	case MI_SYNTHETIC:
+		werase(ui.win);
+		provider_loop(MI_SYNTHETIC);
+		break;
 	case MI_CLEAN:
 		erase();
 		break;
@@ -749,7 +1683,7 @@ menu_action()
 		ch = joystick_getch();
 		if (ch == KEY_RIGHT) {
 			system("sudo shutdown -h now");
-			logi("shutdown: %d", errno);
+			rlogi("shutdown: %d", errno);
 			exit(1);
 		}
 		print_status("");
@@ -759,7 +1693,7 @@ menu_action()
 		ch = joystick_getch();
 		if (ch == KEY_RIGHT) {
 			system("sudo reboot");
-			logi("reboot: %d", errno);
+			rlogi("reboot: %d", errno);
 		}
 		print_status("");
 		break;
@@ -770,20 +1704,23 @@ static void
 menu_loop()
 {
 	while (true) {
+		refresh_sessions();
+
 		if (dumb_term) {
 			print_menu();
 		} else {
 			draw_menu();
 			wrefresh(ui.win);
 		}
+		frame_done();
 
-		int ch = joystick_getch();
+		int ch = get_key();
+		key_pending(ch, "screen=menu");
 
 		switch (ch) {
 			case 'q':
 				exit(0);
 			case -1:
-				on_idle();
 				break;
 			case KEY_DOWN:
 				menu.sel++;
@@ -799,6 +1736,9 @@ menu_loop()
 				menu_action();
 				break;
 		}
+
+		if (ch != -1)
+			metrics_since(H_KEY_ACTION, joystick_key_time());
 	}
 }
 
@@ -807,16 +1747,43 @@ main(int argc, char **argv)
 {
 	init(argc, argv);
 
+	if (cache_stats) {
+		pack_print_stats(stdout);
+		return 0;
+	}
+
 	if (activate_box) {
 		activate_tv_box();
 		return 0;
 	}
 
-	log_open("ctv.log");
-	logi("=======================================");
+	/* common/ keeps its own synchronous log, rlog rotates ctv.log */
+	log_open("ctv-common.log");
+	rlog_init("ctv.log", 1024 * 1024, log_level);
+
+	char stats_fname[PATH_MAX];
+	snprintf(stats_fname, PATH_MAX-1, "%sstats.txt", local_dir);
+	metrics_init(stats_fname, 5*60);
+	rlogi("=======================================");
+
+	char offline_dir[PATH_MAX];
+	snprintf(offline_dir, PATH_MAX-1, "%soffline/", local_dir);
+
+	http_init();
+	download_init(offline_dir, download_max_rate, download_url);
+
+	if (download_now) {
+		download_run();
+		return 0;
+	}
+
+	download_start(download_start_hour, download_end_hour);
 
 	joystick_init();
 
+	if (synthetic_entries == 0)
+		menu.count--;
+
 	if (dumb_term) {
 	//	tcgetattr(STDIN_FILENO, &orig_termios);
 	//	struct termios raw;
@@ -835,6 +1802,8 @@ main(int argc, char **argv)
 	}
 
 	status_init(ui.win, ui.height - 2, dumb_term);
+	power_init(5*60);
+	warm_up();
 	menu_loop();
 	
 	return 0;
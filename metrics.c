@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "rlog.h"
+#include "version.h"
+#include "metrics.h"
+
+#define BUCKETS 32          /* bucket i holds durations < 2^i us */
+#define MAX_LABELS 16       /* sub-histograms per histogram */
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[BUCKETS];
+};
+
+struct labelled {
+	const char *label;
+	struct histogram h;
+};
+
+struct shard {
+	uint64_t counters[C_COUNT];
+	struct histogram histograms[H_COUNT];
+	struct labelled labelled[H_COUNT][MAX_LABELS];
+	struct shard *next;
+};
+
+static const char *counter_names[C_COUNT] = {
+	[C_CACHE_HIT]    = "cache_hit",
+	[C_CACHE_MISS]   = "cache_miss",
+	[C_FETCH_BYTES]  = "fetch_bytes",
+	[C_FETCH_ERRORS] = "fetch_errors",
+	[C_FETCH_RETRIES] = "fetch_retries",
+	[C_FETCH_HEDGES] = "fetch_hedges",
+	[C_FETCH_TIMEOUTS] = "fetch_timeouts",
+	[C_KEYS]         = "keys"
+};
+
+static const char *histogram_names[H_COUNT] = {
+	[H_FETCH]      = "fetch_us",
+	[H_JSON_PARSE] = "json_parse_us",
+	[H_HTML_PARSE] = "html_parse_us",
+	[H_LIST_LOAD]  = "list_load_us",
+	[H_DRAW_LIST]  = "draw_list_us",
+	[H_KEY_ACTION] = "key_action_us",
+	[H_DEBOUNCE]   = "debounce_us",
+	[H_WAKE]       = "wake_us",
+	[H_KEY_TO_PIXEL] = "key_to_pixel_us",
+	[H_PLAY_START] = "play_start_us",
+	[H_SEARCH]     = "search_us",
+	[H_LIST_REFRESH] = "list_refresh_us"
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shard *shards;
+static struct shard retired;       /* sum of the shards of exited threads */
+static pthread_key_t shard_key;    /* its destructor retires the shard */
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread struct shard *my_shard;
+static char stats_fname[PATH_MAX];
+static int stats_interval;
+static uint64_t start_time;
+
+static void merge_shard(struct shard *to, const struct shard *from);
+
+static void
+retire_shard(void *arg)
+{
+	struct shard *s = arg, **p;
+
+	pthread_mutex_lock(&shards_lock);
+	merge_shard(&retired, s);
+	for (p = &shards; *p != NULL; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shards_lock);
+
+	free(s);
+	my_shard = NULL;
+}
+
+static void
+make_shard_key()
+{
+	pthread_key_create(&shard_key, retire_shard);
+}
+
+static struct shard *
+get_shard()
+{
+	if (my_shard != NULL)
+		return my_shard;
+
+	my_shard = calloc(1, sizeof(struct shard));
+
+	pthread_mutex_lock(&shards_lock);
+	my_shard->next = shards;
+	shards = my_shard;
+	pthread_mutex_unlock(&shards_lock);
+
+	pthread_once(&shard_key_once, make_shard_key);
+	pthread_setspecific(shard_key, my_shard);
+
+	return my_shard;
+}
+
+uint64_t
+metrics_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void
+metrics_count(enum counter_id id, uint64_t n)
+{
+	get_shard()->counters[id] += n;
+}
+
+static void
+add_sample(struct histogram *h, uint64_t usec)
+{
+	int b = 0;
+
+	while (b < BUCKETS - 1 && usec >= (1ULL << b))
+		b++;
+
+	h->count++;
+	h->sum += usec;
+	h->buckets[b]++;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+static void
+merge(struct histogram *to, const struct histogram *from)
+{
+	int b;
+
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (b = 0; b < BUCKETS; b++)
+		to->buckets[b] += from->buckets[b];
+}
+
+static void
+merge_shard(struct shard *to, const struct shard *from)
+{
+	int i, j, k;
+
+	for (i = 0; i < C_COUNT; i++)
+		to->counters[i] += from->counters[i];
+
+	for (i = 0; i < H_COUNT; i++) {
+		merge(&to->histograms[i], &from->histograms[i]);
+
+		for (j = 0; j < MAX_LABELS && from->labelled[i][j].label != NULL; j++) {
+			const struct labelled *l = &from->labelled[i][j];
+
+			for (k = 0; k < MAX_LABELS; k++) {
+				if (to->labelled[i][k].label == NULL)
+					to->labelled[i][k].label = l->label;
+				if (strcmp(to->labelled[i][k].label, l->label) == 0) {
+					merge(&to->labelled[i][k].h, &l->h);
+					break;
+				}
+			}
+		}
+	}
+}
+
+void
+metrics_time(enum histogram_id id, uint64_t usec)
+{
+	add_sample(&get_shard()->histograms[id], usec);
+}
+
+void
+metrics_time_label(enum histogram_id id, const char *label, uint64_t usec)
+{
+	struct labelled *l = get_shard()->labelled[id];
+	int i;
+
+	for (i = 0; i < MAX_LABELS; i++) {
+		if (l[i].label == NULL)
+			l[i].label = label;
+		if (strcmp(l[i].label, label) == 0) {
+			add_sample(&l[i].h, usec);
+			break;
+		}
+	}
+}
+
+/* upper bound of the bucket holding the p-th percentile */
+static uint64_t
+percentile(const struct histogram *h, int p)
+{
+	uint64_t rank = (h->count * p + 99) / 100, seen = 0;
+	int b;
+
+	for (b = 0; b < BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank && seen > 0)
+			return (b == BUCKETS - 1 || (1ULL << b) > h->max) ? h->max : (1ULL << b);
+	}
+
+	return 0;
+}
+
+static void
+write_histogram(FILE *f, const char *name, const char *label, const struct histogram *h)
+{
+	fprintf(f, "histogram %s%s%s%s count %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu\n",
+		name, label ? "[" : "", label ? label : "", label ? "]" : "",
+		(unsigned long long)h->count,
+		(unsigned long long)(h->count ? h->sum / h->count : 0),
+		(unsigned long long)percentile(h, 50),
+		(unsigned long long)percentile(h, 90),
+		(unsigned long long)percentile(h, 99),
+		(unsigned long long)h->max);
+}
+
+/* shards are read without locking, values may be off by an update in flight */
+void
+metrics_write(FILE *f)
+{
+	struct shard sum, *s;
+	char host[64] = "";
+	int i, j;
+
+	pthread_mutex_lock(&shards_lock);
+	sum = retired;
+	for (s = shards; s != NULL; s = s->next)
+		merge_shard(&sum, s);
+	pthread_mutex_unlock(&shards_lock);
+
+	gethostname(host, sizeof(host) - 1);
+
+	fprintf(f, "host %s\n", host);
+	fprintf(f, "version %s %s\n", app_version, app_date);
+	fprintf(f, "time %ld\n", (long)time(NULL));
+	fprintf(f, "uptime_sec %llu\n", (unsigned long long)((metrics_now() - start_time) / 1000000));
+
+	for (i = 0; i < C_COUNT; i++)
+		fprintf(f, "counter %s %llu\n", counter_names[i], (unsigned long long)sum.counters[i]);
+
+	for (i = 0; i < H_COUNT; i++) {
+		write_histogram(f, histogram_names[i], NULL, &sum.histograms[i]);
+
+		for (j = 0; j < MAX_LABELS && sum.labelled[i][j].label != NULL; j++)
+			write_histogram(f, histogram_names[i], sum.labelled[i][j].label, &sum.labelled[i][j].h);
+	}
+}
+
+void
+metrics_save()
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	if (stats_fname[0] == 0)
+		return;
+
+	snprintf(tmp, PATH_MAX-1, "%s.tmp", stats_fname);
+	f = fopen(tmp, "wt");
+	if (f == NULL) {
+		rlogw("cannot write %s", tmp);
+		return;
+	}
+
+	metrics_write(f);
+	fclose(f);
+	rename(tmp, stats_fname);
+}
+
+static void *
+writer(void *arg)
+{
+	while (true) {
+		sleep(stats_interval);
+		metrics_save();
+	}
+
+	return NULL;
+}
+
+void
+metrics_init(const char *fname, int interval_sec)
+{
+	pthread_t th;
+
+	start_time = metrics_now();
+	snprintf(stats_fname, PATH_MAX-1, "%s", fname);
+	stats_interval = interval_sec;
+
+	atexit(metrics_save);
+
+	if (pthread_create(&th, NULL, writer, NULL) != 0) {
+		rlogw("cannot start stats writer");
+		return;
+	}
+
+	pthread_detach(th);
+}
@@ -0,0 +1,57 @@
+/*
+ * Counters and latency histograms. Every thread updates its own shard,
+ * shards are summed when stats are written, so updates never contend.
+ * Stats are written to a file periodically and at exit.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum counter_id {
+	C_CACHE_HIT,
+	C_CACHE_MISS,
+	C_FETCH_BYTES,
+	C_FETCH_ERRORS,
+	C_FETCH_RETRIES,
+	C_FETCH_HEDGES,
+	C_FETCH_TIMEOUTS,
+	C_KEYS,
+	C_COUNT
+};
+
+enum histogram_id {
+	H_FETCH,            /* http round trip */
+	H_JSON_PARSE,
+	H_HTML_PARSE,
+	H_LIST_LOAD,        /* provider->load() */
+	H_DRAW_LIST,
+	H_KEY_ACTION,       /* key capture to handled */
+	H_DEBOUNCE,         /* joystick_getch() debounce waits */
+	H_WAKE,             /* monitor wake key to usable ui */
+	H_KEY_TO_PIXEL,     /* key capture to the refresh showing its result */
+	H_PLAY_START,       /* play key to the player being started */
+	H_SEARCH,           /* search_find() of a type-ahead query */
+	H_LIST_REFRESH,     /* provider->fetch_changes(), apply_changes() not included */
+	H_COUNT
+};
+
+void metrics_init(const char *fname, int interval_sec);
+
+/* monotonic time in microseconds */
+uint64_t metrics_now();
+
+void metrics_count(enum counter_id id, uint64_t n);
+
+/* record duration in microseconds */
+void metrics_time(enum histogram_id id, uint64_t usec);
+
+/* record into a sub-histogram of id, label must be a string literal */
+void metrics_time_label(enum histogram_id id, const char *label, uint64_t usec);
+
+/* record time passed since start, which is metrics_now() */
+#define metrics_since(id, start) metrics_time((id), metrics_now() - (start))
+
+void metrics_write(FILE *f);
+
+/* write the stats file now */
+void metrics_save();
@@ -0,0 +1,639 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "rlog.h"
+#include "pack.h"
+
+#define PACK_MAGIC 0x324b5043   /* "CPK2", "CPAK" records had no header in the crc */
+#define COMPACT_MIN_DEAD (1024 * 1024)
+#define QUARANTINE_MAX (1024 * 1024)
+
+/* record: header, key, data. Tombstones have no data and expires == 0 */
+struct record_header {
+	uint32_t magic;
+	uint32_t crc;           /* of the header with crc 0, key and data */
+	uint32_t key_len;
+	uint32_t data_len;
+	int64_t expires;
+	int64_t stored;
+};
+
+struct pack_entry {
+	char *key;
+	off_t offset;           /* of the record */
+	uint32_t data_len;
+	time_t expires;
+	time_t atime;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char pack_fname[PATH_MAX];
+static int fd = -1;
+static off_t file_size;
+static off_t dead_bytes;
+static long long budget_bytes;
+
+static struct pack_entry *entries;
+static int count;
+static int capacity;
+static int *slots;
+static int slots_size;
+
+static int quarantined;
+
+static uint32_t crc_table[256];
+
+static void
+crc_init()
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t
+crc32(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static uint32_t
+record_crc(const struct record_header *h, const char *key, const char *data)
+{
+	struct record_header zero = *h;
+
+	zero.crc = 0;
+	return crc32(crc32(crc32(0, &zero, sizeof(zero)), key, h->key_len), data, h->data_len);
+}
+
+static size_t
+record_size(uint32_t key_len, uint32_t data_len)
+{
+	return sizeof(struct record_header) + key_len + data_len;
+}
+
+unsigned
+pack_hash(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+
+	return h;
+}
+
+static unsigned
+hash(const char *s)
+{
+	return pack_hash(s, strlen(s));
+}
+
+static int
+find_slot(const char *key)
+{
+	unsigned i = hash(key) & (slots_size - 1);
+
+	while (slots[i] != -1 && strcmp(entries[slots[i]].key, key) != 0)
+		i = (i + 1) & (slots_size - 1);
+
+	return i;
+}
+
+static void
+rehash()
+{
+	int i;
+
+	free(slots);
+	slots = malloc(sizeof(int) * slots_size);
+	memset(slots, 0xff, sizeof(int) * slots_size);
+
+	for (i = 0; i < count; i++)
+		slots[find_slot(entries[i].key)] = i;
+}
+
+static struct pack_entry *
+lookup(const char *key)
+{
+	if (slots_size == 0)
+		return NULL;
+
+	int slot = find_slot(key);
+	return (slots[slot] == -1) ? NULL : &entries[slots[slot]];
+}
+
+static struct pack_entry *
+add(const char *key)
+{
+	if (count == capacity) {
+		capacity = (capacity == 0) ? 256 : capacity * 2;
+		entries = realloc(entries, sizeof(struct pack_entry) * capacity);
+	}
+
+	if (count * 2 >= slots_size) {
+		slots_size = (slots_size == 0) ? 512 : slots_size * 2;
+		rehash();
+	}
+
+	struct pack_entry *e = &entries[count];
+	memset(e, 0, sizeof(struct pack_entry));
+	e->key = strdup(key);
+	slots[find_slot(key)] = count;
+	count++;
+
+	return e;
+}
+
+/*
+ * Backward shift deletion: the slot is emptied and the later entries of
+ * its probe run move up, so no lookup passes a hole.
+ */
+static void
+unslot(const char *key)
+{
+	unsigned mask = slots_size - 1, hole = find_slot(key), i = hole, home;
+
+	for (;;) {
+		slots[hole] = -1;
+		do {
+			i = (i + 1) & mask;
+			if (slots[i] == -1)
+				return;
+			home = hash(entries[slots[i]].key) & mask;
+		} while (((i - home) & mask) < ((i - hole) & mask));
+
+		slots[hole] = slots[i];
+		hole = i;
+	}
+}
+
+static void
+delete(struct pack_entry *e)
+{
+	int i = e - entries;
+
+	dead_bytes += record_size(strlen(e->key), e->data_len);
+	unslot(e->key);
+	free(e->key);
+
+	/* the last entry takes the place */
+	if (i != --count) {
+		slots[find_slot(entries[count].key)] = i;
+		*e = entries[count];
+	}
+}
+
+static void
+clear_index()
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(entries[i].key);
+
+	count = 0;
+	if (slots_size > 0)
+		rehash();
+}
+
+/* keep a corrupt record for inspection in pack.quarantine, it is not used again */
+static void
+quarantine(const struct record_header *h, const char *rec, size_t n, off_t offset)
+{
+	char fname[PATH_MAX];
+	struct stat st;
+	int qfd;
+
+	rlogw("pack: corrupt record at %jd, quarantined", (intmax_t)offset);
+	quarantined++;
+
+	snprintf(fname, PATH_MAX-1, "%s.quarantine", pack_fname);
+	if (stat(fname, &st) == 0 && st.st_size > QUARANTINE_MAX)
+		unlink(fname);
+
+	qfd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (qfd == -1)
+		return;
+
+	struct iovec iov[2] = {
+		{ (void *)h, sizeof(*h) },
+		{ (void *)rec, n }
+	};
+	writev(qfd, iov, 2);
+	close(qfd);
+}
+
+/* apply record to the index */
+static void
+index_record(const struct record_header *h, const char *key, off_t offset)
+{
+	struct pack_entry *e = lookup(key);
+
+	if (e != NULL)
+		delete(e);
+
+	if (h->expires == 0) {
+		dead_bytes += record_size(h->key_len, 0);
+		return;
+	}
+
+	e = add(key);
+	e->offset = offset;
+	e->data_len = h->data_len;
+	e->expires = h->expires;
+	e->atime = h->stored;
+}
+
+enum {
+	RECORD_OK,
+	RECORD_BAD,             /* no record starts here */
+	RECORD_CORRUPT          /* the header fits the file, the crc does not match */
+};
+
+/* reads the record at offset into rec, the key followed by the data */
+static int
+read_record(off_t offset, struct record_header *h, char **rec, size_t *rec_cap)
+{
+	if (pread(fd, h, sizeof(*h), offset) != sizeof(*h) ||
+	    h->magic != PACK_MAGIC || h->key_len == 0 || h->key_len > PATH_MAX ||
+	    offset + (off_t)record_size(h->key_len, h->data_len) > file_size)
+		return RECORD_BAD;
+
+	size_t n = h->key_len + h->data_len;
+	if (n + 1 > *rec_cap) {
+		*rec_cap = n + 1;
+		*rec = realloc(*rec, *rec_cap);
+	}
+
+	if (pread(fd, *rec, n, offset + sizeof(*h)) != (ssize_t)n)
+		return RECORD_BAD;
+
+	if (record_crc(h, *rec, *rec + h->key_len) != h->crc)
+		return RECORD_CORRUPT;
+
+	return RECORD_OK;
+}
+
+/* offset of the first intact record after from, -1 if there is none */
+static off_t
+find_record(off_t from, char **rec, size_t *rec_cap)
+{
+	struct record_header h;
+	uint32_t magic = PACK_MAGIC;
+	char buf[65536];
+	ssize_t i, got;
+
+	while ((got = pread(fd, buf, sizeof(buf), from)) >= (ssize_t)sizeof(magic)) {
+		for (i = 0; i + (ssize_t)sizeof(magic) <= got; i++) {
+			if (memcmp(buf + i, &magic, sizeof(magic)) == 0 &&
+			    read_record(from + i, &h, rec, rec_cap) == RECORD_OK)
+				return from + i;
+		}
+		from += got - (sizeof(magic) - 1);
+	}
+
+	return -1;
+}
+
+/*
+ * Read all records. A bad record is skipped up to the next intact one,
+ * the pack is truncated only where no intact record follows, a tail torn
+ * by an interrupted write.
+ */
+static void
+load()
+{
+	struct record_header h;
+	char *rec = NULL;
+	size_t rec_cap = 0;
+	off_t offset = 0, next;
+	int rc;
+
+	file_size = lseek(fd, 0, SEEK_END);
+
+	while (offset < file_size) {
+		rc = read_record(offset, &h, &rec, &rec_cap);
+		if (rc == RECORD_OK) {
+			rec[h.key_len] = 0;
+			index_record(&h, rec, offset);
+			offset += record_size(h.key_len, h.data_len);
+			continue;
+		}
+
+		if (rc == RECORD_CORRUPT)
+			quarantine(&h, rec, h.key_len + h.data_len, offset);
+
+		next = find_record(offset + 1, &rec, &rec_cap);
+		if (next == -1)
+			break;
+
+		rlogw("pack: bad record at %jd, skipped %jd bytes",
+			(intmax_t)offset, (intmax_t)(next - offset));
+		dead_bytes += next - offset;
+		offset = next;
+	}
+
+	free(rec);
+
+	if (offset < file_size) {
+		rlogw("pack: broken record at %jd, truncate %jd bytes",
+			(intmax_t)offset, (intmax_t)(file_size - offset));
+		ftruncate(fd, offset);
+		file_size = offset;
+	}
+}
+
+static int
+append(const char *key, const char *data, uint32_t data_len, time_t expires)
+{
+	struct record_header h = {
+		.magic = PACK_MAGIC,
+		.key_len = strlen(key),
+		.data_len = data_len,
+		.expires = expires,
+		.stored = time(NULL)
+	};
+	struct iovec iov[3] = {
+		{ &h, sizeof(h) },
+		{ (void *)key, h.key_len },
+		{ (void *)data, data_len }
+	};
+
+	h.crc = record_crc(&h, key, data);
+
+	ssize_t n = writev(fd, iov, 3);
+	if (n != (ssize_t)record_size(h.key_len, data_len)) {
+		rlogw("pack: write %s failed", key);
+		if (n > 0)
+			ftruncate(fd, file_size);
+		return -1;
+	}
+
+	index_record(&h, key, file_size);
+	file_size += n;
+
+	return 0;
+}
+
+static int
+cmp_recent(const void *a, const void *b)
+{
+	const struct pack_entry *ea = a, *eb = b;
+
+	return (ea->atime < eb->atime) - (ea->atime > eb->atime);
+}
+
+/* called under lock */
+static int
+compact()
+{
+	char tmp[PATH_MAX];
+	char *rec = NULL;
+	size_t rec_cap = 0;
+	off_t offset = 0;
+	off_t target = budget_bytes * 3 / 4;  /* leave room before next compaction */
+	time_t now = time(NULL);
+	int i, tmp_fd;
+
+	snprintf(tmp, PATH_MAX-1, "%s.tmp", pack_fname);
+	tmp_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (tmp_fd == -1) {
+		rlogw("pack: cannot create %s", tmp);
+		return -1;
+	}
+
+	/* most recently used records are kept first */
+	qsort(entries, count, sizeof(struct pack_entry), cmp_recent);
+
+	for (i = 0; i < count; i++) {
+		struct pack_entry *e = &entries[i];
+		size_t n = record_size(strlen(e->key), e->data_len);
+
+		if (e->expires < now || offset + (off_t)n > target) {
+			free(e->key);
+			e->key = NULL;
+			continue;
+		}
+
+		if (n > rec_cap) {
+			rec_cap = n;
+			rec = realloc(rec, rec_cap);
+		}
+
+		if (pread(fd, rec, n, e->offset) != (ssize_t)n || write(tmp_fd, rec, n) != (ssize_t)n) {
+			rlogw("pack: compaction failed");
+			free(rec);
+			close(tmp_fd);
+			unlink(tmp);
+			/* offsets of already moved entries are wrong, reload */
+			clear_index();
+			dead_bytes = 0;
+			load();
+			return -1;
+		}
+
+		e->offset = offset;
+		offset += n;
+	}
+
+	free(rec);
+	fsync(tmp_fd);
+	close(tmp_fd);
+	rename(tmp, pack_fname);
+
+	/* drop dropped entries from the index */
+	int live = 0;
+	for (i = 0; i < count; i++) {
+		if (entries[i].key != NULL)
+			entries[live++] = entries[i];
+	}
+	count = live;
+	rehash();
+
+	close(fd);
+	fd = open(pack_fname, O_RDWR | O_APPEND);
+	file_size = offset;
+	dead_bytes = 0;
+
+	rlogi("pack compacted: %d records, %jd bytes", count, (intmax_t)file_size);
+	return 0;
+}
+
+static void
+compact_if_needed()
+{
+	if (dead_bytes > COMPACT_MIN_DEAD && dead_bytes > file_size / 2)
+		compact();
+	else if (file_size > budget_bytes)
+		compact();
+}
+
+int
+pack_open(const char *fname, long long max_bytes)
+{
+	crc_init();
+
+	pthread_mutex_lock(&lock);
+
+	snprintf(pack_fname, PATH_MAX-1, "%s", fname);
+	budget_bytes = max_bytes;
+
+	fd = open(fname, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (fd == -1) {
+		rlogw("pack: cannot open %s", fname);
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	clear_index();
+	dead_bytes = 0;
+	load();
+
+	/* rewrite without the corrupt records, not to find them on every start */
+	if (quarantined > 0)
+		compact();
+	else
+		compact_if_needed();
+
+	pthread_mutex_unlock(&lock);
+
+	rlogi("pack: %d records, %jd bytes, %jd dead", count, (intmax_t)file_size, (intmax_t)dead_bytes);
+	return 0;
+}
+
+void
+pack_close()
+{
+	pthread_mutex_lock(&lock);
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+char *
+pack_get(const char *key, size_t *len)
+{
+	struct pack_entry *e;
+	char *data = NULL;
+
+	pthread_mutex_lock(&lock);
+
+	if (fd == -1)
+		goto out;
+
+	e = lookup(key);
+	if (e == NULL || e->expires < time(NULL))
+		goto out;
+
+	size_t key_len = strlen(key);
+	size_t n = key_len + e->data_len;
+	char *rec = malloc(n + 1);
+	off_t offset = e->offset + sizeof(struct record_header);
+	struct record_header h = { 0 };
+
+	/* header must describe the indexed record, then the checksum */
+	if (pread(fd, &h, sizeof(h), e->offset) != sizeof(h) ||
+	    h.magic != PACK_MAGIC || h.key_len != key_len || h.data_len != e->data_len ||
+	    pread(fd, rec, n, offset) != (ssize_t)n ||
+	    record_crc(&h, rec, rec + key_len) != h.crc) {
+		quarantine(&h, rec, n, e->offset);
+		free(rec);
+		/* tombstone, so the record is not indexed again after restart */
+		append(key, NULL, 0, 0);
+		goto out;
+	}
+
+	memmove(rec, rec + key_len, e->data_len);
+	rec[e->data_len] = 0;
+	data = rec;
+
+	if (len != NULL)
+		*len = e->data_len;
+
+	e->atime = time(NULL);
+
+out:
+	pthread_mutex_unlock(&lock);
+	return data;
+}
+
+int
+pack_put(const char *key, const char *data, size_t len, time_t expires)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&lock);
+	if (fd != -1) {
+		rc = append(key, data, len, expires);
+		compact_if_needed();
+	}
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
+
+void
+pack_remove(const char *key)
+{
+	pthread_mutex_lock(&lock);
+	if (fd != -1 && lookup(key) != NULL)
+		append(key, NULL, 0, 0);
+	pthread_mutex_unlock(&lock);
+}
+
+int
+pack_compact()
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&lock);
+	if (fd != -1)
+		rc = compact();
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
+
+void
+pack_print_stats(FILE *f)
+{
+	long long live = 0;
+	int i;
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < count; i++)
+		live += record_size(strlen(entries[i].key), entries[i].data_len);
+
+	fprintf(f, "pack:         %s\n", pack_fname);
+	fprintf(f, "records:      %d\n", count);
+	fprintf(f, "pack bytes:   %jd of %lld, %lld live, %jd dead\n",
+		(intmax_t)file_size, budget_bytes, live, (intmax_t)dead_bytes);
+	fprintf(f, "quarantined:  %d\n", quarantined);
+
+	pthread_mutex_unlock(&lock);
+}
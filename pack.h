@@ -0,0 +1,25 @@
+/*
+ * Append-only store for cached responses. All records live in one pack
+ * file, an in-memory index maps key to offset, length and expiry time.
+ * Records are checksummed, dead and expired ones are dropped by compaction.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+int pack_open(const char *fname, long long max_bytes);
+void pack_close();
+
+/* copy of the value or NULL if it is missing or expired. Must be freed. */
+char *pack_get(const char *key, size_t *len);
+
+int pack_put(const char *key, const char *data, size_t len, time_t expires);
+void pack_remove(const char *key);
+
+/* rewrite the pack keeping only live records within the budget */
+int pack_compact();
+
+void pack_print_stats(FILE *f);
+
+/* FNV-1a of len bytes, for index slots and body fingerprints */
+unsigned pack_hash(const void *data, size_t len);
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "rlog.h"
+#include "util.h"
+#include "metrics.h"
+#include "power.h"
+
+enum monitor_state {
+	MON_ON,
+	MON_TURNING_OFF,
+	MON_OFF,
+	MON_TURNING_ON
+};
+
+static const char off_cmd[] = "/opt/vc/bin/tvservice -o >> tvservice.log 2>&1";
+static const char on_cmd[] =
+	"/opt/vc/bin/tvservice -p >> tvservice.log 2>&1; "
+	"sleep 5; setterm --reset >> tvservice.log";
+
+#define CHILD_POLL_MS 250
+
+static enum monitor_state state = MON_ON;
+static int idle_ms;
+static uint64_t last_key;
+static uint64_t wake_key;       /* time of the key which woke the monitor */
+static bool wake_pending;
+static bool on_requested;       /* key came while turning off */
+static bool redraw_pending;
+static pid_t child = -1;
+
+static uint64_t
+now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static pid_t
+spawn(const char *cmd)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+
+	if (pid == -1)
+		rlogw("cannot fork: %s", cmd);
+
+	return pid;
+}
+
+static void
+turn_off()
+{
+	rlogi("turning off monitor");
+	child = spawn(off_cmd);
+	state = (child == -1) ? MON_ON : MON_TURNING_OFF;
+}
+
+static void
+turn_on()
+{
+	rlogi("turning on monitor");
+	child = spawn(on_cmd);
+	state = (child == -1) ? MON_OFF : MON_TURNING_ON;
+}
+
+/* child finished, move to the next state */
+static void
+on_child_exit(int status)
+{
+	int rc = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+	child = -1;
+
+	if (rc != 0) {
+		rlogw("error: %d. You may need to set chmod u+s /opt/vc/bin/tvservice", rc);
+		/* retry after the next idle period, not in a loop */
+		last_key = now_ms();
+	}
+
+	if (state == MON_TURNING_OFF) {
+		state = (rc == 0) ? MON_OFF : MON_ON;
+		if (state == MON_OFF)
+			statusf("monitor is off");
+		if (on_requested) {
+			on_requested = false;
+			turn_on();
+		}
+	} else if (state == MON_TURNING_ON) {
+		state = MON_ON;
+		redraw_pending = true;
+		last_key = now_ms();
+	}
+}
+
+void
+power_init(int idle_sec)
+{
+	idle_ms = idle_sec * 1000;
+	last_key = now_ms();
+}
+
+int
+power_timeout()
+{
+	if (child != -1)
+		return CHILD_POLL_MS;
+
+	if (state != MON_ON)
+		return -1;
+
+	uint64_t now = now_ms();
+	uint64_t deadline = last_key + idle_ms;
+
+	return (now >= deadline) ? 0 : (int)(deadline - now);
+}
+
+void
+power_tick()
+{
+	int status;
+
+	if (child != -1 && waitpid(child, &status, WNOHANG) == child)
+		on_child_exit(status);
+
+	if (state == MON_ON && child == -1 && now_ms() >= last_key + idle_ms)
+		turn_off();
+}
+
+bool
+power_key()
+{
+	last_key = now_ms();
+
+	switch (state) {
+	case MON_ON:
+		return false;
+	case MON_TURNING_ON:
+		/* monitor is coming, keys work as usual */
+		return false;
+	case MON_TURNING_OFF:
+		on_requested = true;
+		break;
+	case MON_OFF:
+		turn_on();
+		break;
+	}
+
+	wake_key = last_key;
+	wake_pending = true;
+	return true;
+}
+
+bool
+power_redraw()
+{
+	bool rc = redraw_pending;
+
+	redraw_pending = false;
+	return rc;
+}
+
+void
+power_ui_ready()
+{
+	if (!wake_pending || state != MON_ON || redraw_pending)
+		return;
+
+	wake_pending = false;
+	metrics_time(H_WAKE, (now_ms() - wake_key) * 1000);
+	rlogi("wake latency: %d ms", (int)(now_ms() - wake_key));
+}
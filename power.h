@@ -0,0 +1,24 @@
+/*
+ * Monitor power management. The monitor is turned off after idle_sec
+ * without keys and turned back on by any key. tvservice commands run as
+ * child processes, so input is handled while the monitor switches.
+ */
+
+#include <stdbool.h>
+
+void power_init(int idle_sec);
+
+/* poll timeout in ms until the next power event, -1 to wait for a key */
+int power_timeout();
+
+/* check children and the idle deadline, call after every wait */
+void power_tick();
+
+/* register a key. Returns true if the key only woke the monitor up. */
+bool power_key();
+
+/* true once after the monitor is back and the screen must be redrawn */
+bool power_redraw();
+
+/* screen is usable again, reports keypress to usable ui latency */
+void power_ui_ready();
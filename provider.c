@@ -0,0 +1,21 @@
+#include <stdlib.h>
+#include "provider.h"
+
+void
+append_movie(struct movie_list *list, struct movie_entry *e)
+{
+	list->items = realloc(list->items, sizeof (struct movie_entry) * (list->count + 1));
+	list->items[list->count] = e;
+	list->count++;
+}
+
+void
+free_movie(struct movie_entry *e)
+{
+	free(e->name);
+	free(e->description);
+	free(e->on_air);
+	free(e->part_on_air);
+	free(e->stream_url);
+	free(e);
+}
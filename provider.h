@@ -9,8 +9,12 @@ struct movie_entry {
 	char *name;
 	char *description;
 	char *on_air;
+	int duration;        /* 0 if unknown */
 	int children_count;
 	int sel;             /* selected child */
+	char *part_on_air;   /* of the selected child as last drawn, NULL if unknown */
+	int part_duration;
+	int part_sel;        /* child part_on_air is of */
 	int bitrate;
 	enum stream_format format;
 	char *stream_url;
@@ -20,8 +24,21 @@ struct movie_list {
 	int count;
 	int sel;             /* selected index */
 	struct movie_entry **items;
+	char *title;         /* of the tab */
+	int tabs_count;      /* lists shown as tabs instead of the items */
+	int tab;             /* selected tab */
+	struct movie_list **tabs;
 };
 
+/* limits of every provider api request */
+#define PROVIDER_DEADLINE_MS 15000
+#define PROVIDER_RETRIES 3
+
+struct list_changes;     /* of the provider */
+
+void append_movie(struct movie_list *list, struct movie_entry *e);
+void free_movie(struct movie_entry *e);
+
 struct provider {
 	char *name;
 
@@ -34,4 +51,14 @@ struct provider {
 	struct movie_list *(*load)();
 	char *(*get_stream_url)(struct movie_entry *e);
 	struct movie_entry *(*get_movie)(int parent_id, int idx);
+	/* part known without requests or NULL, optional */
+	struct movie_entry *(*find_movie)(int parent_id, int idx);
+	/*
+	 * Refresh of the list load() returned, optional. The changes are fetched
+	 * on any thread without touching the list, then applied in place on the
+	 * thread that shows it. apply_changes frees them and returns their
+	 * number or -1.
+	 */
+	struct list_changes *(*fetch_changes)(struct movie_list *list);
+	int (*apply_changes)(struct movie_list *list, struct list_changes *changes);
 };
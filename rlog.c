@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "rlog.h"
+
+#define RING_SIZE 1024             /* power of 2 */
+#define RING_MASK (RING_SIZE - 1)
+#define MSG_SIZE 240
+#define CRASH_RECORDS 200
+
+/* seq == pos + 1: ready to write out, seq == pos + RING_SIZE: slot is free */
+struct slot {
+	atomic_uint seq;
+	int level;
+	int tid;
+	struct timespec ts;
+	char msg[MSG_SIZE];
+};
+
+static struct slot ring[RING_SIZE];
+static atomic_uint head;
+static unsigned tail;
+static atomic_uint dropped;
+
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t pending;
+static atomic_bool started;
+static enum rlog_level min_level = RLOG_INFO;
+static char log_fname[PATH_MAX];
+static char crash_fname[PATH_MAX];
+static FILE *out;
+static long out_size;
+static long rotate_size;
+
+static const char level_chars[] = "DIWE";
+
+static void
+init_ring()
+{
+	unsigned i;
+
+	for (i = 0; i < RING_SIZE; i++)
+		atomic_init(&ring[i].seq, i);
+}
+
+void
+rlog(enum rlog_level level, const char *fmt, ...)
+{
+	unsigned pos, seq;
+	struct slot *s;
+	va_list args;
+
+	if (level < min_level)
+		return;
+
+	pos = atomic_load_explicit(&head, memory_order_relaxed);
+
+	while (true) {
+		s = &ring[pos & RING_MASK];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		int diff = (int)(seq - pos);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* ring is full, never wait for the flusher */
+			atomic_fetch_add(&dropped, 1);
+			return;
+		} else {
+			pos = atomic_load_explicit(&head, memory_order_relaxed);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &s->ts);
+	s->level = level;
+	s->tid = syscall(SYS_gettid);
+
+	va_start(args, fmt);
+	vsnprintf(s->msg, MSG_SIZE, fmt, args);
+	va_end(args);
+
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+
+	if (atomic_load_explicit(&started, memory_order_acquire))
+		sem_post(&pending);
+}
+
+static void
+rotate()
+{
+	char old[PATH_MAX];
+
+	fclose(out);
+	snprintf(old, PATH_MAX-1, "%s.1", log_fname);
+	rename(log_fname, old);
+
+	out = fopen(log_fname, "a");
+	out_size = 0;
+}
+
+static void
+write_record(const struct slot *s)
+{
+	struct tm tm;
+	char tbuf[32];
+	size_t len = strnlen(s->msg, MSG_SIZE);
+
+	localtime_r(&s->ts.tv_sec, &tm);
+	strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+
+	/* strip \r left from the raw terminal era */
+	while (len > 0 && (s->msg[len-1] == '\r' || s->msg[len-1] == '\n'))
+		len--;
+
+	out_size += fprintf(out, "%s.%03ld %c %d %.*s\n", tbuf, s->ts.tv_nsec / 1000000,
+			    level_chars[s->level], s->tid, (int)len, s->msg);
+}
+
+/* called under consumer_lock */
+static void
+drain()
+{
+	struct slot *s;
+	unsigned seq, n;
+	int count = 0;
+
+	if (out == NULL)
+		return;
+
+	while (true) {
+		s = &ring[tail & RING_MASK];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq != tail + 1)
+			break;
+
+		write_record(s);
+		atomic_store_explicit(&s->seq, tail + RING_SIZE, memory_order_release);
+		tail++;
+		count++;
+	}
+
+	n = atomic_exchange(&dropped, 0);
+	if (n > 0)
+		out_size += fprintf(out, "--- %u records dropped\n", n);
+
+	if (count > 0 || n > 0)
+		fflush(out);
+
+	if (rotate_size > 0 && out_size > rotate_size && out != stderr)
+		rotate();
+}
+
+static void *
+flusher(void *arg)
+{
+	while (true) {
+		while (sem_wait(&pending) != 0)
+			;
+
+		/* batch records arrived together */
+		while (sem_trywait(&pending) == 0)
+			;
+
+		pthread_mutex_lock(&consumer_lock);
+		drain();
+		pthread_mutex_unlock(&consumer_lock);
+	}
+
+	return NULL;
+}
+
+static size_t
+fmt_uint(char *buf, unsigned long v)
+{
+	char tmp[24];
+	size_t n = 0, i;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+
+	for (i = 0; i < n; i++)
+		buf[i] = tmp[n - i - 1];
+
+	return n;
+}
+
+/* only async-signal-safe calls here */
+static void
+on_crash(int sig)
+{
+	unsigned pos = atomic_load(&head);
+	unsigned i, start = (pos > CRASH_RECORDS) ? pos - CRASH_RECORDS : 0;
+	char line[MSG_SIZE + 64];
+	size_t n;
+	int fd;
+
+	fd = open(crash_fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd != -1) {
+		n = fmt_uint(line, sig);
+		write(fd, "signal ", 7);
+		write(fd, line, n);
+		write(fd, "\n", 1);
+
+		for (i = start; i != pos; i++) {
+			struct slot *s = &ring[i & RING_MASK];
+			unsigned seq = atomic_load(&s->seq);
+
+			/* written and not yet overwritten by a newer record */
+			if (seq != i + 1 && seq != i + RING_SIZE)
+				continue;
+
+			n = fmt_uint(line, s->ts.tv_sec);
+			line[n++] = ' ';
+			line[n++] = level_chars[s->level];
+			line[n++] = ' ';
+			size_t len = strnlen(s->msg, MSG_SIZE);
+			memcpy(line + n, s->msg, len);
+			n += len;
+			line[n++] = '\n';
+			write(fd, line, n);
+		}
+
+		close(fd);
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void
+rlog_init(const char *fname, long max_size, enum rlog_level level)
+{
+	static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+	struct stat st;
+	pthread_t th;
+	unsigned i;
+
+	min_level = level;
+	rotate_size = max_size;
+
+	if (fname == NULL) {
+		out = stderr;
+	} else {
+		snprintf(log_fname, PATH_MAX-1, "%s", fname);
+		snprintf(crash_fname, PATH_MAX-1, "%s.crash", fname);
+		out = fopen(fname, "a");
+		if (out == NULL)
+			out = stderr;
+		if (stat(fname, &st) == 0)
+			out_size = st.st_size;
+
+		for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++)
+			signal(crash_signals[i], on_crash);
+	}
+
+	sem_init(&pending, 0, 0);
+
+	if (pthread_create(&th, NULL, flusher, NULL) != 0) {
+		fprintf(stderr, "cannot start log flusher\n");
+		return;
+	}
+
+	pthread_detach(th);
+	atomic_store(&started, true);
+	atexit(rlog_flush);
+
+	/* records logged before init */
+	sem_post(&pending);
+}
+
+void
+rlog_flush()
+{
+	pthread_mutex_lock(&consumer_lock);
+	drain();
+	pthread_mutex_unlock(&consumer_lock);
+}
+
+static void __attribute__((constructor))
+rlog_constructor()
+{
+	init_ring();
+}
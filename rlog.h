@@ -0,0 +1,29 @@
+/*
+ * Asynchronous logger. Records go to a lock-free ring buffer and are
+ * written by a background thread, so logging never blocks the caller.
+ * Log is rotated by size. On crash the last records go to fname.crash.
+ *
+ * Errors that must reach the disk before the process exits go through
+ * logfatal() from common/log, which writes synchronously to ctv-common.log.
+ * Pending records are flushed at exit, so rlog output is not lost either.
+ */
+
+enum rlog_level {
+	RLOG_DEBUG,
+	RLOG_INFO,
+	RLOG_WARN,
+	RLOG_ERROR
+};
+
+/* fname NULL logs to stderr. max_size 0 disables rotation. */
+void rlog_init(const char *fname, long max_size, enum rlog_level level);
+
+void rlog(enum rlog_level level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* write pending records now */
+void rlog_flush();
+
+#define rlogd(...) rlog(RLOG_DEBUG, __VA_ARGS__)
+#define rlogi(...) rlog(RLOG_INFO, __VA_ARGS__)
+#define rlogw(...) rlog(RLOG_WARN, __VA_ARGS__)
+#define rloge(...) rlog(RLOG_ERROR, __VA_ARGS__)
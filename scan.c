@@ -0,0 +1,85 @@
+#include <string.h>
+#include <stdint.h>
+#include "scan.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+bool
+scan_is_literal(const char *pattern)
+{
+	return strpbrk(pattern, ".[]()*+?{}|^$\\") == NULL;
+}
+
+static const char *
+find_scalar(const char *text, size_t len, const char *needle, size_t nlen, size_t i)
+{
+	const char first = needle[0];
+
+	for (; i + nlen <= len; i++) {
+		if (text[i] == first && memcmp(text + i + 1, needle + 1, nlen - 1) == 0)
+			return text + i;
+	}
+
+	return NULL;
+}
+
+/*
+ * Compare the first and the last byte of the needle at 16 positions at
+ * once, memcmp only the positions where both are equal.
+ */
+const char *
+scan_find(const char *text, size_t len, const char *needle, size_t nlen)
+{
+	size_t i = 0;
+
+	if (nlen == 0)
+		return text;
+	if (nlen > len)
+		return NULL;
+
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+
+	for (; i + nlen - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(text + i + nlen - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+								_mm_cmpeq_epi8(b, last)));
+
+		while (mask != 0) {
+			unsigned bit = __builtin_ctz(mask);
+			if (memcmp(text + i + bit + 1, needle + 1, nlen - 1) == 0)
+				return text + i + bit;
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t first = vdupq_n_u8(needle[0]);
+	const uint8x16_t last = vdupq_n_u8(needle[nlen - 1]);
+	uint8_t eq[16];
+	int k;
+
+	for (; i + nlen - 1 + 16 <= len; i += 16) {
+		uint8x16_t a = vld1q_u8((const uint8_t *)(text + i));
+		uint8x16_t b = vld1q_u8((const uint8_t *)(text + i + nlen - 1));
+		uint8x16_t c = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+		uint64x2_t c64 = vreinterpretq_u64_u8(c);
+
+		if ((vgetq_lane_u64(c64, 0) | vgetq_lane_u64(c64, 1)) == 0)
+			continue;
+
+		vst1q_u8(eq, c);
+		for (k = 0; k < 16; k++) {
+			if (eq[k] && memcmp(text + i + k + 1, needle + 1, nlen - 1) == 0)
+				return text + i + k;
+		}
+	}
+#endif
+
+	return find_scalar(text, len, needle, nlen, i);
+}
@@ -0,0 +1,12 @@
+/*
+ * Substring search for literal delimiters, SSE2 or NEON when available.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* true if the extended regex pattern matches only itself */
+bool scan_is_literal(const char *pattern);
+
+/* first occurrence of needle in text[0..len), NULL if none */
+const char *scan_find(const char *text, size_t len, const char *needle, size_t nlen);
@@ -0,0 +1,325 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search.h"
+
+#define MAX_NAME 512
+#define MIN_BUCKETS 1024
+
+/* ids of the names containing the trigram, ascending */
+struct posting {
+	uint64_t trigram;       /* 0 if the bucket is free */
+	int count;
+	int capacity;
+	int *ids;
+};
+
+struct search_index {
+	char **names;           /* folded */
+	int count;
+	int capacity;
+	struct posting *buckets;
+	int buckets_count;      /* power of two */
+	int used;
+};
+
+static uint32_t
+next_char(const unsigned char **p)
+{
+	const unsigned char *s = *p;
+	uint32_t c = *s++;
+	int n = 0;
+
+	if (c >= 0xf0) {
+		c &= 0x07;
+		n = 3;
+	} else if (c >= 0xe0) {
+		c &= 0x0f;
+		n = 2;
+	} else if (c >= 0xc0) {
+		c &= 0x1f;
+		n = 1;
+	}
+
+	/* broken sequences are taken byte by byte */
+	while (n-- > 0 && (*s & 0xc0) == 0x80)
+		c = (c << 6) | (*s++ & 0x3f);
+
+	*p = s;
+	return c;
+}
+
+static uint32_t
+fold_char(uint32_t c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c + 0x20;
+	if (c >= 0xc0 && c <= 0xde && c != 0xd7)      /* latin-1 */
+		return c + 0x20;
+	if (c >= 0x410 && c <= 0x42f)                 /* А-Я */
+		return c + 0x20;
+	if (c >= 0x400 && c <= 0x40f)                 /* Ѐ-Џ */
+		c += 0x50;
+	if (c == 0x451)                               /* ё */
+		return 0x435;
+
+	return c;
+}
+
+static int
+put_char(uint32_t c, char *out)
+{
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		out[0] = 0xc0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	if (c < 0x10000) {
+		out[0] = 0xe0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3f);
+		out[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | (c >> 18);
+	out[1] = 0x80 | ((c >> 12) & 0x3f);
+	out[2] = 0x80 | ((c >> 6) & 0x3f);
+	out[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+void
+search_fold(const char *s, char *out, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	size_t len = 0;
+	char c[4];
+	int n;
+
+	while (*p) {
+		n = put_char(fold_char(next_char(&p)), c);
+		if (len + n >= size)
+			break;
+		memcpy(out + len, c, n);
+		len += n;
+	}
+	out[len] = 0;
+}
+
+static unsigned
+bucket_of(const struct search_index *ix, uint64_t trigram)
+{
+	return (trigram * 0x9e3779b97f4a7c15ULL) >> 32 & (ix->buckets_count - 1);
+}
+
+static struct posting *
+find_posting(const struct search_index *ix, uint64_t trigram)
+{
+	unsigned i = bucket_of(ix, trigram);
+
+	while (ix->buckets[i].trigram != 0) {
+		if (ix->buckets[i].trigram == trigram)
+			return &ix->buckets[i];
+		i = (i + 1) & (ix->buckets_count - 1);
+	}
+
+	return &ix->buckets[i];
+}
+
+static void
+grow_buckets(struct search_index *ix)
+{
+	struct posting *old = ix->buckets;
+	int i, old_count = ix->buckets_count;
+
+	ix->buckets_count = (old_count == 0) ? MIN_BUCKETS : old_count * 2;
+	ix->buckets = calloc(ix->buckets_count, sizeof(struct posting));
+
+	for (i = 0; i < old_count; i++) {
+		if (old[i].trigram != 0)
+			*find_posting(ix, old[i].trigram) = old[i];
+	}
+	free(old);
+}
+
+static void
+add_trigram(struct search_index *ix, uint64_t trigram, int id)
+{
+	struct posting *p;
+
+	if (ix->used * 2 >= ix->buckets_count)
+		grow_buckets(ix);
+
+	p = find_posting(ix, trigram);
+	if (p->trigram == 0) {
+		p->trigram = trigram;
+		ix->used++;
+	}
+
+	/* repeated in the same name */
+	if (p->count > 0 && p->ids[p->count - 1] == id)
+		return;
+
+	if (p->count == p->capacity) {
+		p->capacity = (p->capacity == 0) ? 4 : p->capacity * 2;
+		p->ids = realloc(p->ids, sizeof(int) * p->capacity);
+	}
+	p->ids[p->count++] = id;
+}
+
+/* calls fn for every trigram of the folded string */
+static void
+for_trigrams(const char *folded, void (*fn)(uint64_t, void *), void *arg)
+{
+	const unsigned char *p = (const unsigned char *)folded;
+	uint64_t a = 0, b = 0, c;
+	int n = 0;
+
+	while (*p) {
+		c = next_char(&p);
+		if (++n >= 3)
+			fn(a << 42 | b << 21 | c, arg);
+		a = b;
+		b = c;
+	}
+}
+
+struct add_arg {
+	struct search_index *ix;
+	int id;
+};
+
+static void
+add_one(uint64_t trigram, void *arg)
+{
+	struct add_arg *a = arg;
+
+	add_trigram(a->ix, trigram, a->id);
+}
+
+struct search_index *
+search_new()
+{
+	struct search_index *ix = calloc(1, sizeof(struct search_index));
+
+	grow_buckets(ix);
+
+	return ix;
+}
+
+void
+search_free(struct search_index *ix)
+{
+	int i;
+
+	if (ix == NULL)
+		return;
+
+	for (i = 0; i < ix->count; i++)
+		free(ix->names[i]);
+	for (i = 0; i < ix->buckets_count; i++)
+		free(ix->buckets[i].ids);
+	free(ix->names);
+	free(ix->buckets);
+	free(ix);
+}
+
+int
+search_add(struct search_index *ix, const char *name)
+{
+	char folded[MAX_NAME];
+	struct add_arg arg = { ix, ix->count };
+
+	search_fold(name != NULL ? name : "", folded, sizeof(folded));
+
+	if (ix->count == ix->capacity) {
+		ix->capacity = (ix->capacity == 0) ? 256 : ix->capacity * 2;
+		ix->names = realloc(ix->names, sizeof(char *) * ix->capacity);
+	}
+	ix->names[ix->count] = strdup(folded);
+
+	for_trigrams(folded, add_one, &arg);
+
+	return ix->count++;
+}
+
+void
+search_remove(struct search_index *ix, int id)
+{
+	free(ix->names[id]);
+	ix->names[id] = NULL;
+}
+
+bool
+search_same_name(const struct search_index *ix, int id, const char *name)
+{
+	char folded[MAX_NAME];
+
+	search_fold(name != NULL ? name : "", folded, sizeof(folded));
+	return ix->names[id] != NULL && strcmp(ix->names[id], folded) == 0;
+}
+
+int
+search_count(const struct search_index *ix)
+{
+	return ix->count;
+}
+
+struct rarest_arg {
+	const struct search_index *ix;
+	const struct posting *rarest;
+	bool missing;
+};
+
+static void
+rarest_one(uint64_t trigram, void *arg)
+{
+	struct rarest_arg *a = arg;
+	const struct posting *p = find_posting(a->ix, trigram);
+
+	if (p->trigram == 0)
+		a->missing = true;
+	else if (a->rarest == NULL || p->count < a->rarest->count)
+		a->rarest = p;
+}
+
+/*
+ * Names having the rarest trigram of the query are the candidates, the
+ * folded names are checked for the whole query. Queries shorter than a
+ * trigram check the names in order until max are found.
+ */
+int
+search_find(const struct search_index *ix, const char *query, int *ids, int max)
+{
+	char folded[MAX_NAME];
+	struct rarest_arg arg = { ix, NULL, false };
+	int i, n = 0;
+
+	search_fold(query, folded, sizeof(folded));
+	if (folded[0] == 0)
+		return 0;
+
+	for_trigrams(folded, rarest_one, &arg);
+	if (arg.missing)
+		return 0;
+
+	if (arg.rarest == NULL) {
+		for (i = 0; i < ix->count && n < max; i++) {
+			if (ix->names[i] != NULL && strstr(ix->names[i], folded) != NULL)
+				ids[n++] = i;
+		}
+		return n;
+	}
+
+	for (i = 0; i < arg.rarest->count && n < max; i++) {
+		int id = arg.rarest->ids[i];
+		if (ix->names[id] != NULL && strstr(ix->names[id], folded) != NULL)
+			ids[n++] = id;
+	}
+
+	return n;
+}
@@ -0,0 +1,31 @@
+/*
+ * Substring search over names with a trigram index. Names and queries are
+ * case folded, Cyrillic included and ё written as е, so "тайны" finds
+ * "ТАЙНЫ ВЕКА". Removed names stay as tombstones, ids are never reused.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct search_index;
+
+struct search_index *search_new();
+void search_free(struct search_index *ix);
+
+/* returns the id of the name, ids are consecutive from 0 */
+int search_add(struct search_index *ix, const char *name);
+
+/* the name is no longer found, its id stays taken */
+void search_remove(struct search_index *ix, int id);
+
+/* true if the id is not removed and its name folds the same as name */
+bool search_same_name(const struct search_index *ix, int id, const char *name);
+
+/* ids added so far, removed ones included */
+int search_count(const struct search_index *ix);
+
+/* ids of the first max names containing the query in the order they were added */
+int search_find(const struct search_index *ix, const char *query, int *ids, int max);
+
+/* folded utf-8 copy of s, truncated to size */
+void search_fold(const char *s, char *out, size_t size);
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include "provider.h"
+#include "rlog.h"
+#include "selections.h"
+
+int
+selections_save(const char *fname, const struct movie_list *list)
+{
+	int i;
+	FILE *f;
+	struct movie_entry *e;
+
+	if (list == NULL)
+		return 0;
+
+	f = fopen(fname, "wt");
+	if (f == NULL)
+		return -1;
+
+	fprintf(f, "list.sel = %d\n", list->sel);
+	for (i = 0; i < list->count; i++) {
+		e = list->items[i];
+		fprintf(f, "movie.%d.sel = %d\n", e->id, e->sel);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+void
+selections_load(const char *fname, struct movie_list *list)
+{
+	int i, n, v, id, j, k;
+	FILE *f;
+	struct movie_entry *e;
+
+	if (list == NULL)
+		return;
+
+	f = fopen(fname, "rt");
+	if (f == NULL)
+		return;
+
+	n = fscanf(f, "list.sel = %d\n", &v);
+	if (n != 1) {
+		fclose(f);
+		return;
+	}
+
+	if (v >= 0 && v < list->count)
+		list->sel = v;
+
+	for (i = 0; i < list->count; i++) {
+		n = fscanf(f, "movie.%d.sel = %d\n", &id, &v);
+		if (n != 2)
+			break;
+
+		/* saved in list order, search from the same position */
+		for (k = 0; k < list->count; k++) {
+			j = (i + k) % list->count;
+			e = list->items[j];
+			if (e->id == id && v < e->children_count) {
+				e->sel = v;
+				break;
+			}
+		}
+	}
+
+	fclose(f);
+	rlogi("selections loaded");
+}
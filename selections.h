@@ -0,0 +1,8 @@
+/*
+ * Selected movie and selected parts of the list, saved between runs.
+ */
+
+struct movie_list;
+
+int selections_save(const char *fname, const struct movie_list *list);
+void selections_load(const char *fname, struct movie_list *list);
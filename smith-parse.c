@@ -2,10 +2,16 @@
 #include <stdlib.h>
 #include "provider.h"
 #include "smithsonian.h"
+#include "pack.h"
 
 int main()
 {
 	int i;
+	char fname[1024];
+
+	snprintf(fname, sizeof(fname), "%s/.cache/etvcc/cache.pack", getenv("HOME"));
+	pack_open(fname, 64 * 1024 * 1024);
+
 	struct provider *p = smithsonian_get_provider();
 	struct movie_list *list = p->load();
 
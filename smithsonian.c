@@ -2,39 +2,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <libxml/HTMLparser.h>
 #include "provider.h"
-#include "common/log.h"
-#include "common/fs.h"
-#include "common/net.h"
-#include "common/regexp.h"
-#include "util.h"
+#include "rlog.h"
+#include "pack.h"
+#include "http.h"
+#include "metrics.h"
+#include "trace.h"
+#include "smithsonian.h"
+
+#define MAX_EPISODES 20
+#define INDEX_KEY "smithsonian-index"
+#define INDEX_TTL (2*24*3600)           /* then the episodes page is checked again */
+#define INDEX_EXPIRES (30*24*3600)      /* entries are reused while the page is unchanged */
 
 static struct provider *provider;
+static pthread_mutex_t provider_lock = PTHREAD_MUTEX_INITIALIZER;
 static char last_error[4096];
+static const char *site_root = "http://www.smithsonianchannel.com";  /* CTV_SMITHSONIAN_ROOT overrides */
 
 static int
-fetch(const char *url, const char *name, struct buf *buf)
+fetch(const char *url, const char *name, struct http_buf *buf)
 {
 	int rc;
-	char fname[PATH_MAX];
+	char key[PATH_MAX];
 
-	snprintf(fname, PATH_MAX-1, "%s/.cache/etvcc/smithsonian-%s.txt", getenv("HOME"), name);
-	if (!expired(fname, 2*24*3600))
-		return read_text(fname, buf);
+	snprintf(key, PATH_MAX-1, "smithsonian-%s", name);
+	buf->data = pack_get(key, &buf->len);
+	metrics_count(buf->data != NULL ? C_CACHE_HIT : C_CACHE_MISS, 1);
+	if (buf->data != NULL)
+		return 0;
 
-	struct httpreq_opts opts = {
-		.resp_fname = fname,
+	struct http_opts opts = {
+		.buf = buf,
+		.deadline_ms = PROVIDER_DEADLINE_MS,
+		.retries = PROVIDER_RETRIES,
+		.hedge = true,
 		.error = last_error,
 		.error_size = 4096
 	};
 
-	rc = httpreq(url, NULL, &opts);
+	rc = http_get(url, &opts);
 	if (rc != 0) {
 		provider->error_number = rc;
 		return rc;
 	}
 
-	return read_text(fname, buf);
+	pack_put(key, buf->data, buf->len, time(NULL) + 2*24*3600);
+	return 0;
 }
 
 static void
@@ -53,96 +72,374 @@ smith_error()
 	return last_error;
 }
 
-static struct movie_list *
-smith_load(struct provider *p)
+static const char *
+get_attr(const xmlChar **attrs, const char *name)
 {
-	const int N = 20;
-	regex_t rex_episode, rex_title, rex_bcid;
-	struct buf episodes_html;
-	struct buf title_html;
-	regmatch_t m[N];
-	char *chunks[N];
-	char full_url[1024];
-	char name[1024];
-	int rc, i;
+	int i;
+
+	for (i = 0; attrs != NULL && attrs[i] != NULL; i += 2) {
+		if (strcmp((const char *)attrs[i], name) == 0)
+			return (const char *)attrs[i+1];
+	}
+
+	return NULL;
+}
+
+struct episodes_state {
+	int li_depth;           /* > 0 inside an episode <li> */
+	bool has_url;
+	int count;
+	int max;
+	char **urls;
+};
+
+static void
+on_episodes_start(void *ctx, const xmlChar *name, const xmlChar **attrs)
+{
+	struct episodes_state *st = ctx;
+	const char *v;
+
+	if (strcmp((const char *)name, "li") == 0) {
+		if (st->li_depth > 0) {
+			st->li_depth++;
+		} else if (get_attr(attrs, "data-premium") != NULL) {
+			st->li_depth = 1;
+			st->has_url = false;
+		}
+		return;
+	}
+
+	if (st->li_depth == 0 || st->has_url || st->count == st->max)
+		return;
+
+	if (strcmp((const char *)name, "a") == 0 && (v = get_attr(attrs, "href")) != NULL) {
+		st->urls[st->count++] = strdup(v);
+		st->has_url = true;
+	}
+}
+
+static void
+on_episodes_end(void *ctx, const xmlChar *name)
+{
+	struct episodes_state *st = ctx;
+
+	if (st->li_depth > 0 && strcmp((const char *)name, "li") == 0)
+		st->li_depth--;
+}
+
+struct episode_state {
+	char *title;
+	char *bcid;
+};
+
+static void
+on_episode_start(void *ctx, const xmlChar *name, const xmlChar **attrs)
+{
+	struct episode_state *st = ctx;
+	const char *v;
+
+	if (st->title == NULL && strcmp((const char *)name, "meta") == 0) {
+		v = get_attr(attrs, "property");
+		if (v != NULL && strcmp(v, "og:title") == 0 && (v = get_attr(attrs, "content")) != NULL)
+			st->title = strdup(v);
+	}
+
+	if (st->bcid == NULL && (v = get_attr(attrs, "data-bcid")) != NULL)
+		st->bcid = strdup(v);
+}
+
+/* push parser fed as the page arrives, callbacks collect the data */
+struct html_parser {
+	htmlParserCtxtPtr ctx;
+	uint64_t usec;
+};
+
+static void
+html_start(struct html_parser *p, htmlSAXHandler *sax, void *state)
+{
+	p->ctx = htmlCreatePushParserCtxt(sax, state, NULL, 0, NULL, XML_CHAR_ENCODING_UTF8);
+	htmlCtxtUseOptions(p->ctx, HTML_PARSE_NOERROR | HTML_PARSE_NOWARNING | HTML_PARSE_NONET);
+	p->usec = 0;
+}
+
+static void
+html_feed(struct html_parser *p, const char *data, size_t len, bool last)
+{
+	uint64_t start = metrics_now();
+
+	trace_begin("parse_html");
+	htmlParseChunk(p->ctx, data, len, last);
+	trace_end("parse_html");
+
+	p->usec += metrics_now() - start;
+}
+
+static void
+html_finish(struct html_parser *p)
+{
+	htmlFreeParserCtxt(p->ctx);
+	metrics_time(H_HTML_PARSE, p->usec);
+}
+
+/* single pass over the whole page */
+static void
+parse_html(const char *html, size_t len, htmlSAXHandler *sax, void *state)
+{
+	struct html_parser p;
+
+	html_start(&p, sax, state);
+	html_feed(&p, html, len, true);
+	html_finish(&p);
+}
+
+int
+smith_parse_episodes(const char *html, size_t len, char **urls, int max)
+{
+	struct episodes_state st = { .max = max, .urls = urls };
+	htmlSAXHandler sax;
+
+	memset(&sax, 0, sizeof(sax));
+	sax.startElement = on_episodes_start;
+	sax.endElement = on_episodes_end;
+
+	parse_html(html, len, &sax, &st);
+	return st.count;
+}
+
+static void
+episode_sax(htmlSAXHandler *sax)
+{
+	memset(sax, 0, sizeof(*sax));
+	sax->startElement = on_episode_start;
+}
+
+static int
+episode_result(struct episode_state *st, char **title, char **bcid)
+{
+	if (st->title == NULL || st->bcid == NULL) {
+		free(st->title);
+		free(st->bcid);
+		return -1;
+	}
+
+	*title = st->title;
+	*bcid = st->bcid;
+	return 0;
+}
+
+int
+smith_parse_episode(const char *html, size_t len, char **title, char **bcid)
+{
+	struct episode_state st = { NULL, NULL };
+	htmlSAXHandler sax;
+
+	episode_sax(&sax);
+	parse_html(html, len, &sax, &st);
+
+	return episode_result(&st, title, bcid);
+}
+
+struct episode_fetch {
+	struct html_parser parser;
+	struct episode_state st;
+};
+
+static bool
+on_episode_body(const char *data, size_t len, void *arg)
+{
+	struct episode_fetch *f = arg;
+
+	html_feed(&f->parser, data, len, false);
+
+	/* both fields sit near the top, the rest of the page is not needed */
+	return f->st.title == NULL || f->st.bcid == NULL;
+}
+
+/*
+ * Title and bcid of the episode page. The page is parsed while it
+ * downloads and the transfer stops once both are found, only the two
+ * fields are cached.
+ */
+static int
+fetch_episode(const char *url, const char *name, char **title, char **bcid)
+{
+	struct episode_fetch f = { .st = { NULL, NULL } };
+	htmlSAXHandler sax;
+	char key[PATH_MAX];
+	char *data, *p;
+	size_t len;
+	int rc;
+
+	snprintf(key, PATH_MAX-1, "smithsonian-%s", name);
+	data = pack_get(key, &len);
+	metrics_count(data != NULL ? C_CACHE_HIT : C_CACHE_MISS, 1);
+
+	if (data != NULL) {
+		p = strchr(data, '\n');
+		rc = -1;
+		if (p != NULL) {
+			*p = 0;
+			*title = strdup(data);
+			*bcid = strdup(p + 1);
+			rc = 0;
+		}
+		free(data);
+		return rc;
+	}
+
+	struct http_opts opts = {
+		.on_body = on_episode_body,
+		.arg = &f,
+		.deadline_ms = PROVIDER_DEADLINE_MS,
+		.retries = PROVIDER_RETRIES,
+		.error = last_error,
+		.error_size = 4096
+	};
 
-	regex_compile(&rex_episode, "href=\"([^\"]+)\".*srcset=\"([^\"]+)\"");
-	regex_compile(&rex_title, "property=\"og:title\" content=\"([^\"]+)\"");
-	regex_compile(&rex_bcid, "data-bcid=\"([^\"]+)\"");
+	episode_sax(&sax);
+	html_start(&f.parser, &sax, &f.st);
+	rc = http_get(url, &opts);
 
-	buf_init(&episodes_html);
-	memset(chunks, 0, sizeof(char*) * N);
+	/* page ended before the fields were seen, flush the parser */
+	if (rc == 0 && (f.st.title == NULL || f.st.bcid == NULL))
+		html_feed(&f.parser, NULL, 0, true);
+	html_finish(&f.parser);
 
-	rc = fetch("http://www.smithsonianchannel.com/full-episodes", "episodes", &episodes_html);
 	if (rc != 0) {
-		provider->error_number = rc;
-		return NULL;
+		free(f.st.title);
+		free(f.st.bcid);
+		return rc;
 	}
 
-	rc = match_chunks(episodes_html.s, N, m, "data-premium=\"", "</li>");
+	rc = episode_result(&f.st, title, bcid);
 	if (rc != 0) {
-		provider->error_number = 1;
-		snprintf(last_error, 4095, "match_chunks: %d", rc);
-		return NULL;
+		snprintf(last_error, 4095, "no title or bcid in %s", url);
+		return rc;
 	}
 
-	split_chunks(episodes_html.s, N, m, chunks);
+	replace(*title, '\n', ' ');
+	asprintf(&data, "%s\n%s", *title, *bcid);
+	pack_put(key, data, strlen(data), time(NULL) + 2*24*3600);
+	free(data);
 
-	struct movie_list *list = calloc(1, sizeof(struct movie_list));
-	list->items = calloc(N, sizeof(struct movie_entry));
+	return 0;
+}
 
-	for (i = 0; i < N && chunks[i] != NULL; i++) {
-		rc = regexec(&rex_episode, chunks[i], 4, m, 0);
-		if (rc != 0) {
-			provider->error_number = 1;
-			snprintf(last_error, 4095, "rex_episode: %d, i: %d, chunk: %s", rc, i, chunks[i]);
-			return NULL;
-		}
+/*
+ * Scraped entries, so a warm start needs no html. Stored in the pack as
+ * "validator checked" line and a "url title stream_url" line per
+ * episode, tab separated. The validator is the hash of the episodes page.
+ */
+struct index_entry {
+	char *url;
+	char *title;
+	char *stream_url;
+};
 
-		const char *url = &chunks[i][m[1].rm_so];
-		char *end = &chunks[i][m[1].rm_eo];
-		*end = 0;
+struct smith_index {
+	uint32_t validator;
+	time_t checked;
+	int count;
+	struct index_entry items[MAX_EPISODES];
+};
 
-		strcpy(full_url, "http://www.smithsonianchannel.com");
-		strcat(full_url, url);
+static void
+index_free(struct smith_index *ix)
+{
+	int i;
 
-		strcpy(name, url);
-		strcat(name, "-title");
-		replace(name, '/', '-');
+	for (i = 0; i < ix->count; i++) {
+		free(ix->items[i].url);
+		free(ix->items[i].title);
+		free(ix->items[i].stream_url);
+	}
+	ix->count = 0;
+}
 
-		buf_init(&title_html);
-		rc = fetch(full_url, name, &title_html);
-		if (rc != 0) {
-			provider->error_number = 1;
-			return NULL;
-		}
+static bool
+index_load(struct smith_index *ix)
+{
+	char *data, *line, *save, *url, *title, *stream_url;
+	long long checked;
+	unsigned validator;
 
-		struct movie_entry *e = calloc(1, sizeof(struct movie_entry));
+	data = pack_get(INDEX_KEY, NULL);
+	if (data == NULL)
+		return false;
 
-		rc = regexec(&rex_title, title_html.s, 2, m, 0);
-		if (rc != 0) {
-			provider->error_number = 1;
-			return NULL;
-		}
-		asprintf(&e->name, "%.*s", (int)(m[1].rm_eo - m[1].rm_so), &title_html.s[m[1].rm_so]);
+	line = strtok_r(data, "\n", &save);
+	if (line == NULL || sscanf(line, "%x %lld", &validator, &checked) != 2) {
+		free(data);
+		return false;
+	}
+	ix->validator = validator;
+	ix->checked = checked;
 
-		rc = regexec(&rex_bcid, title_html.s, 2, m, 0);
-		if (rc != 0) {
-			provider->error_number = 1;
-			return NULL;
+	while ((line = strtok_r(NULL, "\n", &save)) != NULL && ix->count < MAX_EPISODES) {
+		url = strsep(&line, "\t");
+		title = strsep(&line, "\t");
+		stream_url = strsep(&line, "\t");
+		if (title == NULL || stream_url == NULL)
+			continue;
+
+		ix->items[ix->count].url = strdup(url);
+		ix->items[ix->count].title = strdup(title);
+		ix->items[ix->count].stream_url = strdup(stream_url);
+		ix->count++;
+	}
+
+	free(data);
+	return true;
+}
+
+static void
+index_save(struct smith_index *ix)
+{
+	char *data = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&data, &len);
+	int i;
+
+	fprintf(f, "%08x %lld\n", ix->validator, (long long)ix->checked);
+	for (i = 0; i < ix->count; i++) {
+		fprintf(f, "%s\t%s\t%s\n", ix->items[i].url, ix->items[i].title,
+			ix->items[i].stream_url);
+	}
+	fclose(f);
+
+	pack_put(INDEX_KEY, data, len, time(NULL) + INDEX_EXPIRES);
+	free(data);
+}
+
+/* moves the entry out of the index, NULL if the url is not there */
+static struct index_entry *
+index_take(struct smith_index *ix, const char *url, struct index_entry *e)
+{
+	int i;
+
+	for (i = 0; i < ix->count; i++) {
+		if (ix->items[i].url != NULL && strcmp(ix->items[i].url, url) == 0) {
+			*e = ix->items[i];
+			memset(&ix->items[i], 0, sizeof(struct index_entry));
+			return e;
 		}
+	}
 
-		const char *bcid = &title_html.s[m[1].rm_so];
-		end = &title_html.s[m[1].rm_eo];
-		*end = 0;
+	return NULL;
+}
 
-		asprintf(&e->stream_url,
-			 "http://c.brightcove.com/services/mobile/streaming"
-			 "/index/master.m3u8?videoId=%s&pubId=1466806621001", bcid);
-		
-		
-		buf_clean(&title_html);
+static struct movie_list *
+index_to_list(const struct smith_index *ix)
+{
+	struct movie_list *list = calloc(1, sizeof(struct movie_list));
+	int i;
 
+	list->items = calloc(MAX_EPISODES, sizeof(struct movie_entry *));
+
+	for (i = 0; i < ix->count; i++) {
+		struct movie_entry *e = calloc(1, sizeof(struct movie_entry));
+		e->name = strdup(ix->items[i].title);
+		e->stream_url = strdup(ix->items[i].stream_url);
 		e->id = i;
 		list->items[list->count] = e;
 		list->count++;
@@ -151,13 +448,118 @@ smith_load(struct provider *p)
 	return list;
 }
 
+/* scrape the episode unless the old index has it */
+static int
+index_episode(struct smith_index *old, const char *url, struct index_entry *e)
+{
+	char full_url[1024];
+	char name[1024];
+	char *bcid;
+	int rc;
+
+	if (index_take(old, url, e) != NULL)
+		return 0;
+
+	snprintf(full_url, sizeof(full_url), "%s%s", site_root, url);
+
+	snprintf(name, sizeof(name), "%s-fields", url);
+	replace(name, '/', '-');
+
+	rc = fetch_episode(full_url, name, &e->title, &bcid);
+	if (rc != 0)
+		return rc;
+
+	replace(e->title, '\t', ' ');
+	e->url = strdup(url);
+	asprintf(&e->stream_url,
+		 "http://c.brightcove.com/services/mobile/streaming"
+		 "/index/master.m3u8?videoId=%s&pubId=1466806621001", bcid);
+	free(bcid);
+
+	return 0;
+}
+
+static struct movie_list *
+smith_load(struct provider *p)
+{
+	struct http_buf episodes_html = { 0 };
+	struct smith_index old = { 0 }, ix = { 0 };
+	struct movie_list *list = NULL;
+	char *urls[MAX_EPISODES];
+	char full_url[1024];
+	uint32_t validator;
+	time_t now = time(NULL);
+	int rc, i, count;
+
+	if (index_load(&old) && old.checked + INDEX_TTL > now) {
+		metrics_count(C_CACHE_HIT, 1);
+		list = index_to_list(&old);
+		index_free(&old);
+		return list;
+	}
+
+	snprintf(full_url, sizeof(full_url), "%s/full-episodes", site_root);
+	rc = fetch(full_url, "episodes", &episodes_html);
+	if (rc != 0) {
+		provider->error_number = rc;
+		index_free(&old);
+		return NULL;
+	}
+
+	/* same page, same episodes */
+	validator = pack_hash(episodes_html.data, episodes_html.len);
+	if (old.count > 0 && old.validator == validator) {
+		http_buf_clean(&episodes_html);
+		old.checked = now;
+		index_save(&old);
+		list = index_to_list(&old);
+		index_free(&old);
+		return list;
+	}
+
+	count = smith_parse_episodes(episodes_html.data, episodes_html.len, urls, MAX_EPISODES);
+	http_buf_clean(&episodes_html);
+
+	for (i = 0; i < count; i++) {
+		rc = index_episode(&old, urls[i], &ix.items[ix.count]);
+		if (rc != 0) {
+			provider->error_number = 1;
+			break;
+		}
+		ix.count++;
+	}
+
+	for (i = 0; i < count; i++)
+		free(urls[i]);
+
+	if (provider->error_number == 0) {
+		ix.validator = validator;
+		ix.checked = now;
+		index_save(&ix);
+		list = index_to_list(&ix);
+	}
+
+	index_free(&ix);
+	index_free(&old);
+
+	return list;
+}
+
 struct provider *
 smithsonian_get_provider() {
-	provider = calloc(1, sizeof(struct provider));
+	/* one instance per process, the loaders start in parallel */
+	pthread_mutex_lock(&provider_lock);
+	if (provider == NULL) {
+		provider = calloc(1, sizeof(struct provider));
 
-	provider->name = strdup("smithsonian");
-	provider->load = smith_load;
-	provider->error = smith_error;
+		if (getenv("CTV_SMITHSONIAN_ROOT") != NULL)
+			site_root = getenv("CTV_SMITHSONIAN_ROOT");
+
+		provider->name = strdup("smithsonian");
+		provider->load = smith_load;
+		provider->error = smith_error;
+	}
+	pthread_mutex_unlock(&provider_lock);
 
 	return provider;
 }
@@ -1,2 +1,9 @@
+#include <stddef.h>
+
 struct provider *smithsonian_get_provider();
 
+/* urls of the episodes on the full-episodes page, returns their count */
+int smith_parse_episodes(const char *html, size_t len, char **urls, int max);
+
+/* title and brightcove id of the episode page, 0 if both are found */
+int smith_parse_episode(const char *html, size_t len, char **title, char **bcid);
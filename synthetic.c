@@ -0,0 +1,157 @@
+/* asprintf */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "provider.h"
+#include "rlog.h"
+#include "synthetic.h"
+
+static const char *adjectives[] = {
+	"Тайный", "Последний", "Большой", "Старый", "Ночной", "Северный",
+	"Золотой", "Забытый", "Вечерний", "Московский", "Далёкий", "Новый"
+};
+
+static const char *nouns[] = {
+	"город", "берег", "экспресс", "дозор", "вокзал", "разговор",
+	"маршрут", "сезон", "рассвет", "детектив", "путь", "остров"
+};
+
+static const char *genres[] = {
+	"Сериал", "Новости", "Ток-шоу", "Фильм", "Концерт", "Документальный"
+};
+
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+static int entries = 100000;
+static int max_children = 100;
+static int latency_ms = 0;
+static struct provider *provider;
+static pthread_mutex_t provider_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct movie_list *list;
+
+static void
+wait_latency()
+{
+	if (latency_ms > 0)
+		usleep(latency_ms * 1000);
+}
+
+/* same index gives the same entry */
+static struct movie_entry *
+make_entry(int id, unsigned seed, int children)
+{
+	struct movie_entry *e = calloc(1, sizeof(struct movie_entry));
+	unsigned h = seed * 2654435761u;
+
+	e->id = id;
+	e->children_count = children;
+	e->format = SF_MP4;
+	e->bitrate = 400;
+
+	/* the words repeat after 864 names, the number keeps them apart */
+	asprintf(&e->name, "%s %s %s %u", genres[h % COUNT(genres)],
+		 adjectives[(h >> 8) % COUNT(adjectives)], nouns[(h >> 16) % COUNT(nouns)], seed + 1);
+	asprintf(&e->description, "%s. Выпуск %u", e->name, seed);
+	asprintf(&e->on_air, "20%02u-%02u-%02u", 10 + (h >> 4) % 8, 1 + (h >> 12) % 12, 1 + (h >> 20) % 28);
+
+	return e;
+}
+
+static struct movie_list *
+load()
+{
+	int i;
+
+	provider->error_number = 0;
+	wait_latency();
+
+	if (list != NULL)
+		return list;
+
+	list = calloc(1, sizeof(struct movie_list));
+	list->items = malloc(sizeof(struct movie_entry *) * entries);
+
+	for (i = 0; i < entries; i++) {
+		int children = (i % 3 == 0) ? 0 : 1 + (i * 7919) % max_children;
+		list->items[i] = make_entry(i + 1, i, children);
+	}
+	list->count = entries;
+
+	rlogi("synthetic: %d entries", entries);
+	return list;
+}
+
+/* after the entry ids 1..entries, unique while idx < max_children */
+static int
+child_id(int parent_id, int idx)
+{
+	return entries + (parent_id - 1) * max_children + idx + 1;
+}
+
+static struct movie_entry *
+get_movie(int parent_id, int idx)
+{
+	struct movie_entry *e;
+
+	provider->error_number = 0;
+	wait_latency();
+
+	if (list == NULL || parent_id < 1 || parent_id > list->count) {
+		provider->error_number = 1;
+		return NULL;
+	}
+
+	e = make_entry(child_id(parent_id, idx), parent_id * 1000 + idx, 0);
+	free(e->name);
+	asprintf(&e->name, "%s, серия %d", list->items[parent_id - 1]->name, idx + 1);
+
+	return e;
+}
+
+static char *
+get_stream_url(struct movie_entry *e)
+{
+	char *url;
+
+	provider->error_number = 0;
+	wait_latency();
+
+	asprintf(&url, "http://127.0.0.1/synthetic/%d/index.m3u8", e->id);
+	return url;
+}
+
+static const char *
+synthetic_error()
+{
+	return "synthetic provider error";
+}
+
+void
+synthetic_config(int n, int children, int latency)
+{
+	entries = n;
+	max_children = (children > 0) ? children : 1;
+	latency_ms = latency;
+}
+
+struct provider *
+synthetic_get_provider()
+{
+	/* one instance per process, the loaders start in parallel */
+	pthread_mutex_lock(&provider_lock);
+	if (provider == NULL) {
+		provider = calloc(1, sizeof(struct provider));
+
+		provider->name = strdup("synthetic");
+		provider->load = load;
+		provider->error = synthetic_error;
+		provider->get_movie = get_movie;
+		provider->get_stream_url = get_stream_url;
+	}
+	pthread_mutex_unlock(&provider_lock);
+
+	return provider;
+}
@@ -0,0 +1,8 @@
+/*
+ * Synthetic provider for scale testing. Generates entries with Cyrillic
+ * names and children, every call waits latency_ms.
+ */
+
+void synthetic_config(int entries, int max_children, int latency_ms);
+
+struct provider *synthetic_get_provider();
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "rlog.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define MAX_EVENTS 32768     /* per thread, oldest events are overwritten */
+
+struct event {
+	const char *name;
+	uint64_t ts;
+	char ph;
+};
+
+struct thread_buf {
+	int tid;
+	unsigned count;
+	struct event *events;
+	struct thread_buf *next;
+};
+
+static bool enabled;
+static char trace_fname[PATH_MAX];
+static FILE *trace_file;           /* open from trace_init till trace_save */
+static const char *sep = "";
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_buf *bufs;
+static pthread_key_t buf_key;      /* its destructor flushes the buffer */
+static pthread_once_t buf_key_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_buf *my_buf;
+
+/* call with bufs_lock held */
+static void
+write_events(const struct thread_buf *b)
+{
+	unsigned i, first;
+	int pid = getpid();
+
+	if (trace_file == NULL)
+		return;
+
+	first = (b->count > MAX_EVENTS) ? b->count - MAX_EVENTS : 0;
+
+	for (i = first; i < b->count; i++) {
+		const struct event *e = &b->events[i % MAX_EVENTS];
+		fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d}",
+			sep, e->name, e->ph, (unsigned long long)e->ts, pid, b->tid);
+		sep = ",\n";
+	}
+}
+
+static void
+retire_buf(void *arg)
+{
+	struct thread_buf *b = arg, **p;
+
+	pthread_mutex_lock(&bufs_lock);
+	write_events(b);
+	for (p = &bufs; *p != NULL; p = &(*p)->next) {
+		if (*p == b) {
+			*p = b->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bufs_lock);
+
+	free(b->events);
+	free(b);
+	my_buf = NULL;
+}
+
+static void
+make_buf_key()
+{
+	pthread_key_create(&buf_key, retire_buf);
+}
+
+static struct thread_buf *
+get_buf()
+{
+	if (my_buf != NULL)
+		return my_buf;
+
+	my_buf = calloc(1, sizeof(struct thread_buf));
+	my_buf->events = malloc(sizeof(struct event) * MAX_EVENTS);
+	my_buf->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&bufs_lock);
+	my_buf->next = bufs;
+	bufs = my_buf;
+	pthread_mutex_unlock(&bufs_lock);
+
+	pthread_once(&buf_key_once, make_buf_key);
+	pthread_setspecific(buf_key, my_buf);
+
+	return my_buf;
+}
+
+static void
+record(const char *name, char ph)
+{
+	struct thread_buf *b = get_buf();
+	struct event *e = &b->events[b->count % MAX_EVENTS];
+
+	e->name = name;
+	e->ph = ph;
+	e->ts = metrics_now();
+	b->count++;
+}
+
+void
+trace_begin(const char *name)
+{
+	if (enabled)
+		record(name, 'B');
+}
+
+void
+trace_end(const char *name)
+{
+	if (enabled)
+		record(name, 'E');
+}
+
+void
+trace_init(const char *fname)
+{
+	snprintf(trace_fname, PATH_MAX-1, "%s", fname);
+	trace_file = fopen(trace_fname, "wt");
+	if (trace_file == NULL) {
+		rlogw("cannot write trace %s", trace_fname);
+		return;
+	}
+	fprintf(trace_file, "{\"traceEvents\":[\n");
+	enabled = true;
+	atexit(trace_save);
+}
+
+void
+trace_save()
+{
+	struct thread_buf *b;
+
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&bufs_lock);
+	for (b = bufs; b != NULL; b = b->next)
+		write_events(b);
+
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&bufs_lock);
+}
@@ -0,0 +1,14 @@
+/*
+ * Span recording in Chrome trace event format (chrome://tracing).
+ * Every thread records into its own buffer, written when the thread exits
+ * or, for threads still running, at exit.
+ * Disabled unless trace_init() was called, then begin/end cost a branch.
+ */
+
+void trace_init(const char *fname);
+
+/* name must be a string literal */
+void trace_begin(const char *name);
+void trace_end(const char *name);
+
+void trace_save();
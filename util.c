@@ -2,7 +2,10 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include "common/log.h"
+#include <pthread.h>
+#include "rlog.h"
+#include "trace.h"
+#include "scan.h"
 #include "common/regexp.h"
 
 static WINDOW *log_win;
@@ -20,51 +23,106 @@ status_init(WINDOW *w, int row, bool dumb_term)
 void
 statusf(const char *fmt, ...)
 {
-	va_list args, cp;
+	va_list args;
+	char msg[1000];
 
+	/* format once for the screen and the log */
 	va_start(args, fmt);
-	va_copy(cp, args);
+	vsnprintf(msg, 999, fmt, args);
+	va_end(args);
 
 	if (log_dumb) {
-		vprintf(fmt, args);
+		printf("%s", msg);
 	} else {
 		wattron(log_win, COLOR_PAIR(2));
 		mvwaddstr(log_win, log_row, 2, "                                                                  ");
-		wmove(log_win, log_row, 3);
-		vwprintw(log_win, fmt, args);
+		mvwaddstr(log_win, log_row, 3, msg);
 		wattroff(log_win, COLOR_PAIR(2));
 		wrefresh(log_win);
 	}
 
-	va_end (args);
+	rlogi("%s", msg);
+}
 
-	va_start(args, fmt);
-	va_copy(cp, args);
+#define REGEX_CACHE_SIZE 8
 
-	char msg[1000];
-	vsnprintf(msg, 999, fmt, args);
-	logi("%s", msg);
+struct cached_regex {
+	char *pattern;
+	regex_t rex;
+};
+
+static struct cached_regex regex_cache[REGEX_CACHE_SIZE];
+static int regex_cache_next;
+static pthread_mutex_t regex_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Compiled once, evicted round robin when the cache is full. The lock is
+ * held across regexec, an eviction on another thread would free the regex.
+ */
+static int
+cached_regexec(const char *pattern, const char *text, regmatch_t *m)
+{
+	struct cached_regex *c;
+	int i, rc;
+
+	pthread_mutex_lock(&regex_cache_lock);
+
+	for (i = 0; i < REGEX_CACHE_SIZE; i++) {
+		c = &regex_cache[i];
+		if (c->pattern != NULL && strcmp(c->pattern, pattern) == 0)
+			goto found;
+	}
 
-	va_end (args);
+	c = &regex_cache[regex_cache_next];
+	regex_cache_next = (regex_cache_next + 1) % REGEX_CACHE_SIZE;
+
+	if (c->pattern != NULL) {
+		free(c->pattern);
+		regfree(&c->rex);
+	}
+
+	c->pattern = strdup(pattern);
+	regex_compile(&c->rex, pattern);
+
+found:
+	rc = regexec(&c->rex, text, 1, m, REG_STARTEND);
+	pthread_mutex_unlock(&regex_cache_lock);
+	return rc;
+}
+
+/* next match of pattern in text[m->rm_so..m->rm_eo), regexec() codes */
+static int
+find_delimiter(const char *text, const char *pattern, bool literal, regmatch_t *m)
+{
+	if (!literal)
+		return cached_regexec(pattern, text, m);
+
+	size_t nlen = strlen(pattern);
+	const char *p = scan_find(text + m->rm_so, m->rm_eo - m->rm_so, pattern, nlen);
+	if (p == NULL)
+		return REG_NOMATCH;
+
+	m->rm_so = p - text;
+	m->rm_eo = m->rm_so + nlen;
+	return 0;
 }
 
 int
 match_chunks(const char *text, int n, regmatch_t *m, const char *start, const char *end)
 {
-	regex_t rex_start;
-	regex_t rex_end;
 	regmatch_t m1, m2;
 	int rc = 0, i;
 	int len = strlen(text);
+	bool start_literal = scan_is_literal(start);
+	bool end_literal = scan_is_literal(end);
 
-	regex_compile(&rex_start, start);
-	regex_compile(&rex_end, end);
+	trace_begin("match_chunks");
 
 	m1.rm_so = 0;
 	m1.rm_eo = len;
 
 	for (i = 0; i < n; i++) {
-		rc = regexec(&rex_start, text, 1, &m1, REG_STARTEND);
+		rc = find_delimiter(text, start, start_literal, &m1);
 
 		if (rc == REG_NOMATCH) {
 			rc = 0;
@@ -77,7 +135,7 @@ match_chunks(const char *text, int n, regmatch_t *m, const char *start, const ch
 		m2.rm_so = m1.rm_eo;
 		m2.rm_eo = len;
 
-		rc = regexec(&rex_end, text, 1, &m2, REG_STARTEND);
+		rc = find_delimiter(text, end, end_literal, &m2);
 
 		if (rc == REG_NOMATCH) {
 			rc = 0;
@@ -99,8 +157,7 @@ match_chunks(const char *text, int n, regmatch_t *m, const char *start, const ch
 		m[i].rm_eo = -1;
 	}
 
-	regfree(&rex_start);
-	regfree(&rex_end);
+	trace_end("match_chunks");
 
 	return rc;
 }
@@ -110,7 +167,7 @@ split_chunks(char *text, int n, const regmatch_t *m, char *chunks[])
 {
 	int i;
 
-	for (i = 0; i < 10; i++) {
+	for (i = 0; i < n; i++) {
 		if (m[i].rm_so == -1)
 			break;
 